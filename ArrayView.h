@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+//Read-only view of a contiguous array owned by someone else, such as a
+//vector or a memory mapped file. The owner must outlive the view.
+template <typename T>
+class ArrayView
+{
+	public:
+		ArrayView();
+		ArrayView(const T *first, size_t count);
+		ArrayView(const std::vector<T> &v);
+
+		const T& operator[](size_t i) const;
+		const T* begin() const;
+		const T* end() const;
+
+		const T* data() const;
+		size_t size() const;
+		size_t sizeBytes() const;
+		bool empty() const;
+
+	protected:
+		const T *first;
+		size_t count;
+
+};
+
+
+
+template <typename T>
+ArrayView<T>::ArrayView()
+{
+	first = nullptr;
+	count = 0;
+}
+
+template <typename T>
+ArrayView<T>::ArrayView(const T *first, size_t count)
+{
+	this->first = first;
+	this->count = count;
+}
+
+template <typename T>
+ArrayView<T>::ArrayView(const std::vector<T> &v)
+{
+	first = v.data();
+	count = v.size();
+}
+
+template <typename T>
+const T& ArrayView<T>::operator[](size_t i) const
+{
+	return first[i];
+}
+
+template <typename T>
+const T* ArrayView<T>::begin() const
+{
+	return first;
+}
+
+template <typename T>
+const T* ArrayView<T>::end() const
+{
+	return first + count;
+}
+
+template <typename T>
+const T* ArrayView<T>::data() const
+{
+	return first;
+}
+
+template <typename T>
+size_t ArrayView<T>::size() const
+{
+	return count;
+}
+
+template <typename T>
+size_t ArrayView<T>::sizeBytes() const
+{
+	return count * sizeof(T);
+}
+
+template <typename T>
+bool ArrayView<T>::empty() const
+{
+	return count == 0;
+}
@@ -0,0 +1,422 @@
+#include "BVH.h"
+
+#include <algorithm>
+#include <chrono>
+
+//Relative costs of visiting a node and of testing a triangle, used by the SAH
+static const float TRAVERSAL_COST = 1.0f;
+static const float INTERSECT_COST = 1.0f;
+
+
+BVH::Bounds::Bounds()
+{
+	min = glm::vec3(1e30f);
+	max = glm::vec3(-1e30f);
+}
+
+void BVH::Bounds::grow(glm::vec3 p)
+{
+	min = glm::min(min, p);
+	max = glm::max(max, p);
+}
+
+void BVH::Bounds::grow(const Bounds &b)
+{
+	min = glm::min(min, b.min);
+	max = glm::max(max, b.max);
+}
+
+float BVH::Bounds::area()
+{
+	glm::vec3 e = max - min;
+	if (e.x < 0)
+	{
+		return 0;
+	}
+	return 2 * (e.x * e.y + e.y * e.z + e.z * e.x);
+}
+
+BVH::BVH()
+{
+	nodesUsed = 0;
+	pool = nullptr;
+	depth = 0;
+	sahCost = 0;
+	buildTime = 0;
+}
+
+void BVH::build(const std::vector<glm::vec3> &positions, std::vector<GLuint> *indices, ThreadPool *pool)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+
+	this->pool = pool;
+	nodes.clear();
+	nodesUsed = 0;
+	depth = 0;
+	sahCost = 0;
+
+	int numTris = indices->size() / 3;
+	if (numTris == 0)
+	{
+		return;
+	}
+
+	//Precompute per triangle bounds and centroids, the build only ever touches these
+	triBounds.resize(numTris);
+	centroids.resize(numTris);
+	triIndices.resize(numTris);
+	pool->parallelFor(0, numTris, BIN_GRAIN_SIZE, [this, &positions, indices](int first, int last)
+	{
+		for (int i = first; i < last; i++)
+		{
+			Bounds b;
+			b.grow(positions[(*indices)[i * 3]]);
+			b.grow(positions[(*indices)[i * 3 + 1]]);
+			b.grow(positions[(*indices)[i * 3 + 2]]);
+			triBounds[i] = b;
+			centroids[i] = (b.min + b.max) * 0.5f;
+			triIndices[i] = i;
+		}
+	});
+
+	//A binary tree with N leaves has at most 2N - 1 nodes
+	nodes.resize(2 * numTris - 1);
+
+	Bounds rootBounds;
+	for (int i = 0; i < numTris; i++)
+	{
+		rootBounds.grow(triBounds[i]);
+	}
+
+	BVHNode &root = nodes[0];
+	root.leftFirst = 0;
+	root.triCount = numTris;
+	root.boundsMin = rootBounds.min;
+	root.boundsMax = rootBounds.max;
+	nodesUsed = 1;
+
+	TaskGroup group;
+	subdivide(0, 1, &group);
+	pool->wait(&group);
+
+	nodes.resize(nodesUsed);
+
+	//Apply the final triangle order
+	std::vector<GLuint> ordered(numTris * 3);
+	pool->parallelFor(0, numTris, BIN_GRAIN_SIZE, [this, indices, &ordered](int first, int last)
+	{
+		for (int i = first; i < last; i++)
+		{
+			ordered[i * 3] = (*indices)[triIndices[i] * 3];
+			ordered[i * 3 + 1] = (*indices)[triIndices[i] * 3 + 1];
+			ordered[i * 3 + 2] = (*indices)[triIndices[i] * 3 + 2];
+		}
+	});
+	indices->swap(ordered);
+
+	triBounds.clear();
+	centroids.clear();
+	triIndices.clear();
+
+	computeStats(0, 1, rootBounds.area());
+
+	auto end = std::chrono::high_resolution_clock::now();
+	buildTime = std::chrono::duration<float, std::milli>(end - start).count();
+}
+
+void BVH::subdivide(int nodeIndex, int nodeDepth, TaskGroup *group)
+{
+	BVHNode &node = nodes[nodeIndex];
+	if (node.triCount <= MIN_LEAF_SIZE || nodeDepth >= MAX_DEPTH)
+	{
+		return;
+	}
+
+	int axis;
+	int splitBin;
+	Bounds cb;
+	Bounds leftBounds;
+	Bounds rightBounds;
+	if (!findSplit(node, &axis, &splitBin, &cb, &leftBounds, &rightBounds))
+	{
+		return;
+	}
+
+	//Partition the triangle indices in place about the chosen plane
+	int i = node.leftFirst;
+	int j = i + node.triCount - 1;
+	while (i <= j)
+	{
+		if (binIndex(triIndices[i], axis, cb) < splitBin)
+		{
+			i++;
+		}
+		else
+		{
+			std::swap(triIndices[i], triIndices[j]);
+			j--;
+		}
+	}
+
+	int leftCount = i - node.leftFirst;
+	if (leftCount == 0 || leftCount == node.triCount)
+	{
+		return;
+	}
+
+	int leftChild = nodesUsed.fetch_add(2);
+	int rightChild = leftChild + 1;
+
+	nodes[leftChild].leftFirst = node.leftFirst;
+	nodes[leftChild].triCount = leftCount;
+	nodes[leftChild].boundsMin = leftBounds.min;
+	nodes[leftChild].boundsMax = leftBounds.max;
+
+	nodes[rightChild].leftFirst = i;
+	nodes[rightChild].triCount = node.triCount - leftCount;
+	nodes[rightChild].boundsMin = rightBounds.min;
+	nodes[rightChild].boundsMax = rightBounds.max;
+
+	node.leftFirst = leftChild;
+	node.triCount = 0;
+
+	//Large subtrees go to the pool, this thread carries on with the other half
+	if (leftCount > PARALLEL_THRESHOLD)
+	{
+		pool->submit(group, [this, leftChild, nodeDepth, group]() { subdivide(leftChild, nodeDepth + 1, group); });
+	}
+	else
+	{
+		subdivide(leftChild, nodeDepth + 1, group);
+	}
+
+	subdivide(rightChild, nodeDepth + 1, group);
+}
+
+BVH::Bounds BVH::computeCentroidBounds(int first, int last)
+{
+	Bounds b;
+	for (int i = first; i < last; i++)
+	{
+		b.grow(centroids[triIndices[i]]);
+	}
+	return b;
+}
+
+bool BVH::findSplit(BVHNode &node, int *axis, int *splitBin, Bounds *cb, Bounds *leftBounds, Bounds *rightBounds)
+{
+	int first = node.leftFirst;
+	int last = node.leftFirst + node.triCount;
+
+	Bin bins[3][NUM_BINS];
+	for (int a = 0; a < 3; a++)
+	{
+		for (int b = 0; b < NUM_BINS; b++)
+		{
+			bins[a][b].count = 0;
+		}
+	}
+
+	if (node.triCount > PARALLEL_BIN_THRESHOLD)
+	{
+		//Each chunk bins into its own array and the results are merged afterwards
+		int numChunks = (node.triCount + BIN_GRAIN_SIZE - 1) / BIN_GRAIN_SIZE;
+		std::vector<Bounds> chunkBounds(numChunks);
+		pool->parallelFor(0, numChunks, 1, [this, first, last, &chunkBounds](int chunk, int)
+		{
+			int chunkFirst = first + chunk * BIN_GRAIN_SIZE;
+			chunkBounds[chunk] = computeCentroidBounds(chunkFirst, std::min(last, chunkFirst + BIN_GRAIN_SIZE));
+		});
+		for (int c = 0; c < numChunks; c++)
+		{
+			cb->grow(chunkBounds[c]);
+		}
+
+		std::vector<Bin> chunkBins(numChunks * 3 * NUM_BINS);
+		pool->parallelFor(0, numChunks, 1, [this, first, last, cb, &chunkBins](int chunk, int)
+		{
+			Bin (*local)[NUM_BINS] = (Bin (*)[NUM_BINS])&chunkBins[chunk * 3 * NUM_BINS];
+			for (int a = 0; a < 3; a++)
+			{
+				for (int b = 0; b < NUM_BINS; b++)
+				{
+					local[a][b].count = 0;
+				}
+			}
+
+			int chunkFirst = first + chunk * BIN_GRAIN_SIZE;
+			fillBins(chunkFirst, std::min(last, chunkFirst + BIN_GRAIN_SIZE), *cb, local);
+		});
+		for (int c = 0; c < numChunks; c++)
+		{
+			for (int a = 0; a < 3; a++)
+			{
+				for (int b = 0; b < NUM_BINS; b++)
+				{
+					Bin &bin = chunkBins[(c * 3 + a) * NUM_BINS + b];
+					bins[a][b].count += bin.count;
+					bins[a][b].bounds.grow(bin.bounds);
+				}
+			}
+		}
+	}
+	else
+	{
+		*cb = computeCentroidBounds(first, last);
+		fillBins(first, last, *cb, bins);
+	}
+
+	Bounds nodeBounds;
+	nodeBounds.min = node.boundsMin;
+	nodeBounds.max = node.boundsMax;
+	float leafCost = node.triCount * INTERSECT_COST;
+	float bestCost = 1e30f;
+
+	for (int a = 0; a < 3; a++)
+	{
+		if (cb->max[a] <= cb->min[a])
+		{
+			continue;
+		}
+
+		//Sweep the planes between bins from both sides to get the area and count left and right of each
+		float leftArea[NUM_BINS - 1];
+		float rightArea[NUM_BINS - 1];
+		int leftCount[NUM_BINS - 1];
+		int rightCount[NUM_BINS - 1];
+
+		Bounds left;
+		Bounds right;
+		int leftSum = 0;
+		int rightSum = 0;
+		for (int b = 0; b < NUM_BINS - 1; b++)
+		{
+			leftSum += bins[a][b].count;
+			left.grow(bins[a][b].bounds);
+			leftCount[b] = leftSum;
+			leftArea[b] = left.area();
+
+			rightSum += bins[a][NUM_BINS - 1 - b].count;
+			right.grow(bins[a][NUM_BINS - 1 - b].bounds);
+			rightCount[NUM_BINS - 2 - b] = rightSum;
+			rightArea[NUM_BINS - 2 - b] = right.area();
+		}
+
+		for (int b = 0; b < NUM_BINS - 1; b++)
+		{
+			if (leftCount[b] == 0 || rightCount[b] == 0)
+			{
+				continue;
+			}
+
+			float cost = leftCount[b] * leftArea[b] + rightCount[b] * rightArea[b];
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				*axis = a;
+				*splitBin = b + 1;
+			}
+		}
+	}
+
+	if (bestCost == 1e30f)
+	{
+		return false;
+	}
+
+	bestCost = TRAVERSAL_COST + INTERSECT_COST * bestCost / nodeBounds.area();
+	if (bestCost >= leafCost && node.triCount <= MAX_LEAF_SIZE)
+	{
+		return false;
+	}
+
+	for (int b = 0; b < NUM_BINS; b++)
+	{
+		if (b < *splitBin)
+		{
+			leftBounds->grow(bins[*axis][b].bounds);
+		}
+		else
+		{
+			rightBounds->grow(bins[*axis][b].bounds);
+		}
+	}
+
+	return true;
+}
+
+void BVH::fillBins(int first, int last, Bounds cb, Bin bins[3][NUM_BINS])
+{
+	for (int i = first; i < last; i++)
+	{
+		int tri = triIndices[i];
+		for (int a = 0; a < 3; a++)
+		{
+			if (cb.max[a] <= cb.min[a])
+			{
+				continue;
+			}
+
+			Bin &bin = bins[a][binIndex(tri, a, cb)];
+			bin.count++;
+			bin.bounds.grow(triBounds[tri]);
+		}
+	}
+}
+
+int BVH::binIndex(int triIndex, int axis, Bounds cb)
+{
+	float scale = NUM_BINS / (cb.max[axis] - cb.min[axis]);
+	int bin = (int)((centroids[triIndex][axis] - cb.min[axis]) * scale);
+	return std::min(std::max(bin, 0), NUM_BINS - 1);
+}
+
+void BVH::computeStats(int nodeIndex, int nodeDepth, float rootArea)
+{
+	BVHNode &node = nodes[nodeIndex];
+	depth = std::max(depth, nodeDepth);
+
+	Bounds b;
+	b.min = node.boundsMin;
+	b.max = node.boundsMax;
+	float relativeArea = rootArea > 0 ? b.area() / rootArea : 1;
+
+	if (node.triCount > 0)
+	{
+		sahCost += INTERSECT_COST * node.triCount * relativeArea;
+		return;
+	}
+
+	sahCost += TRAVERSAL_COST * relativeArea;
+	computeStats(node.leftFirst, nodeDepth + 1, rootArea);
+	computeStats(node.leftFirst + 1, nodeDepth + 1, rootArea);
+}
+
+std::vector<BVHNode> BVH::getNodes()
+{
+	return nodes;
+}
+
+int BVH::getNodeCount()
+{
+	return nodesUsed;
+}
+
+int BVH::getDepth()
+{
+	return depth;
+}
+
+float BVH::getSAHCost()
+{
+	return sahCost;
+}
+
+float BVH::getBuildTime()
+{
+	return buildTime;
+}
+
+BVH::~BVH()
+{
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+#include "Model.h"
+#include "ThreadPool.h"
+
+//Flattened node, laid out to match the std430 BVHNode struct in raycast.csh.
+//Interior nodes store the index of their left child in leftFirst (the right
+//child is always leftFirst + 1) and have a triCount of 0. Leaves store the
+//index of their first triangle in leftFirst.
+struct BVHNode {
+	glm::vec3 boundsMin;
+	GLint leftFirst;
+	glm::vec3 boundsMax;
+	GLint triCount;
+};
+
+//Surface area heuristic BVH built with binned splits. Subtrees above a size
+//threshold are handed to the thread pool so construction scales across cores.
+class BVH
+{
+	public:
+		//Nodes this deep are always leaves. Traversal pushes at most one node per
+		//level below the root, so this must not exceed BVH_STACK_SIZE in raycast.csh
+		static const int MAX_DEPTH = 64;
+
+		BVH();
+		~BVH();
+
+		//Builds the hierarchy over the indexed triangles. The index triples are
+		//reordered in place so that every leaf references a contiguous range.
+		void build(const std::vector<glm::vec3> &positions, std::vector<GLuint> *indices, ThreadPool *pool);
+
+		std::vector<BVHNode> getNodes();
+		int getNodeCount();
+		int getDepth();
+		float getSAHCost();
+		float getBuildTime();
+
+	protected:
+		static const int NUM_BINS = 16;
+		//Nodes this small are always leaves, nodes above MAX_LEAF_SIZE
+		//are always split unless they reach MAX_DEPTH
+		static const int MIN_LEAF_SIZE = 4;
+		static const int MAX_LEAF_SIZE = 16;
+		//Nodes with more triangles than this are split on a separate task
+		static const int PARALLEL_THRESHOLD = 4096;
+		//Nodes with more triangles than this also bin their triangles in parallel
+		static const int PARALLEL_BIN_THRESHOLD = 65536;
+		static const int BIN_GRAIN_SIZE = 16384;
+
+		struct Bounds {
+			glm::vec3 min;
+			glm::vec3 max;
+
+			Bounds();
+			void grow(glm::vec3 p);
+			void grow(const Bounds &b);
+			float area();
+		};
+
+		struct Bin {
+			Bounds bounds;
+			int count;
+		};
+
+		//nodeDepth is 1 at the root
+		void subdivide(int nodeIndex, int nodeDepth, TaskGroup *group);
+		Bounds computeCentroidBounds(int first, int last);
+		bool findSplit(BVHNode &node, int *axis, int *splitBin, Bounds *cb, Bounds *leftBounds, Bounds *rightBounds);
+		void fillBins(int first, int last, Bounds cb, Bin bins[3][NUM_BINS]);
+		int binIndex(int triIndex, int axis, Bounds cb);
+		void computeStats(int nodeIndex, int nodeDepth, float rootArea);
+
+		std::vector<BVHNode> nodes;
+		std::vector<Bounds> triBounds;
+		std::vector<glm::vec3> centroids;
+		std::vector<int> triIndices;
+		std::atomic<int> nodesUsed;
+
+		ThreadPool *pool;
+
+		int depth;
+		float sahCost;
+		float buildTime;
+
+};
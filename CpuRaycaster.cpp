@@ -0,0 +1,960 @@
+#include "CpuRaycaster.h"
+
+#include <algorithm>
+#include <cmath>
+
+//Must match the defines at the top of raycast.csh
+static const float MAX_SCENE_BOUNDS = 100.0f;
+static const int BVH_STACK_SIZE = BVH::MAX_DEPTH;
+static const float SHADOW_BIAS = 0.001f;
+static const float REFLECTIVITY = 0.25f;
+
+#ifdef CPU_RAYCASTER_SSE
+//Pixel offsets of the lanes in a 2x2 packet
+static const int PACKET_X[4] = { 0, 1, 0, 1 };
+static const int PACKET_Y[4] = { 0, 0, 1, 1 };
+
+//Lane-wise std::min(a, b) and std::max(a, b), argument order chosen so NaNs
+//resolve the same way as the scalar path
+static inline __m128 minLanes(__m128 a, __m128 b)
+{
+	return _mm_min_ps(b, a);
+}
+
+static inline __m128 maxLanes(__m128 a, __m128 b)
+{
+	return _mm_max_ps(b, a);
+}
+
+//mask ? a : b per lane
+static inline __m128 selectLanes(__m128 mask, __m128 a, __m128 b)
+{
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+static inline __m128i selectLanes(__m128 mask, __m128i a, __m128i b)
+{
+	__m128i m = _mm_castps_si128(mask);
+	return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b));
+}
+
+static inline int countLanes(int mask)
+{
+	return (mask & 1) + ((mask >> 1) & 1) + ((mask >> 2) & 1) + ((mask >> 3) & 1);
+}
+#endif
+
+
+CpuRaycaster::CpuRaycaster(ThreadPool *pool)
+{
+	this->pool = pool;
+	cubes = nullptr;
+	numCubes = 0;
+	visibleIndices = nullptr;
+	totalCubes = 0;
+	numTriangles = 0;
+	textureArrays = nullptr;
+	pixelWidth = 0;
+	shadows = false;
+	reflectionDepth = 0;
+#ifdef CPU_RAYCASTER_SSE
+	usePackets = true;
+#else
+	usePackets = false;
+#endif
+}
+
+void CpuRaycaster::setCubes(const cube *cubes, int numCubes, const GLuint *visibleIndices, int numVisible)
+{
+	this->cubes = cubes;
+	this->visibleIndices = visibleIndices;
+	this->numCubes = visibleIndices != nullptr ? numVisible : numCubes;
+	totalCubes = numCubes;
+}
+
+void CpuRaycaster::setTriangles(ArrayView<glm::vec3> positions, ArrayView<VertexAttributes> attributes, ArrayView<GLuint> indices, ArrayView<BVHNode> nodes)
+{
+	this->positions = positions;
+	this->attributes = attributes;
+	this->indices = indices;
+	numTriangles = indices.size() / 3;
+	this->nodes = nodes;
+}
+
+void CpuRaycaster::setMaterials(ArrayView<Material> materials)
+{
+	this->materials = materials;
+}
+
+void CpuRaycaster::setTextures(const std::vector<std::vector<TextureLevel>> *arrays)
+{
+	textureArrays = arrays;
+}
+
+void CpuRaycaster::setCamera(glm::vec3 eye, glm::vec3 ray00, glm::vec3 ray01, glm::vec3 ray10, glm::vec3 ray11, glm::vec3 lightPos)
+{
+	this->eye = eye;
+	this->ray00 = ray00;
+	this->ray01 = ray01;
+	this->ray10 = ray10;
+	this->ray11 = ray11;
+	this->lightPos = lightPos;
+}
+
+void CpuRaycaster::setPacketTracing(bool enabled)
+{
+#ifdef CPU_RAYCASTER_SSE
+	usePackets = enabled;
+#endif
+}
+
+void CpuRaycaster::setShadows(bool enabled)
+{
+	shadows = enabled;
+}
+
+void CpuRaycaster::setReflectionDepth(int depth)
+{
+	reflectionDepth = depth;
+}
+
+void CpuRaycaster::render(float *framebuffer, int width, int height)
+{
+	int tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+	int tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+	pixelWidth = glm::length(ray10 - ray00) / (width - 1);
+
+	//One task per tile, idle workers steal tiles so uneven scenes still balance
+	pool->parallelFor(0, tilesX * tilesY, 1, [this, framebuffer, width, height, tilesX](int first, int last)
+	{
+		for (int tile = first; tile < last; tile++)
+		{
+#ifdef CPU_RAYCASTER_SSE
+			if (usePackets && reflectionDepth == 0)
+			{
+				renderTilePackets(framebuffer, width, height, tile % tilesX, tile / tilesX);
+				continue;
+			}
+#endif
+			renderTile(framebuffer, width, height, tile % tilesX, tile / tilesX);
+		}
+	});
+}
+
+void CpuRaycaster::renderTile(float *framebuffer, int width, int height, int tileX, int tileY)
+{
+	int lastX = std::min(width, (tileX + 1) * TILE_SIZE);
+	int lastY = std::min(height, (tileY + 1) * TILE_SIZE);
+
+	for (int y = tileY * TILE_SIZE; y < lastY; y++)
+	{
+		for (int x = tileX * TILE_SIZE; x < lastX; x++)
+		{
+			glm::vec4 colour = trace(eye, getEyeRay(x, y, width, height));
+
+			float *pixel = &framebuffer[(y * width + x) * 4];
+			pixel[0] = colour.x;
+			pixel[1] = colour.y;
+			pixel[2] = colour.z;
+			pixel[3] = colour.w;
+		}
+	}
+}
+
+glm::vec3 CpuRaycaster::getEyeRay(int x, int y, int width, int height)
+{
+	//Same eye ray as main() in compute.csh
+	glm::vec2 pos = glm::vec2(x, y) / glm::vec2(width - 1, height - 1);
+	return glm::mix(glm::mix(ray00, ray01, pos.y), glm::mix(ray10, ray11, pos.y), pos.x);
+}
+
+glm::vec2 CpuRaycaster::getTexCoord(int tri, glm::vec2 uv)
+{
+	glm::vec2 tex0 = attributes[indices[tri * 3]].tex;
+
+	//If the texture co-ords are less than 0
+	//then there is no texture information
+	if (tex0.x > 0)
+	{
+		glm::vec2 tex1 = attributes[indices[tri * 3 + 1]].tex;
+		glm::vec2 tex2 = attributes[indices[tri * 3 + 2]].tex;
+		return uv.x*tex0 + uv.y*tex1 + (1 - uv.x - uv.y)*tex2;
+	}
+
+	return tex0;
+}
+
+float CpuRaycaster::getTexLod(int tri, glm::vec3 dir, float t, const std::vector<TextureLevel> &levels)
+{
+	glm::vec3 p0 = positions[indices[tri * 3]];
+	glm::vec3 p1 = positions[indices[tri * 3 + 1]];
+	glm::vec3 p2 = positions[indices[tri * 3 + 2]];
+	glm::vec2 t0 = attributes[indices[tri * 3]].tex;
+	glm::vec2 t1 = attributes[indices[tri * 3 + 1]].tex;
+	glm::vec2 t2 = attributes[indices[tri * 3 + 2]].tex;
+
+	const TextureLevel &base = levels[0];
+	glm::vec2 texSize = glm::vec2(base.width, base.height);
+	glm::vec2 e1 = (t1 - t0) * texSize;
+	glm::vec2 e2 = (t2 - t0) * texSize;
+	float texArea = std::abs(e1.x * e2.y - e2.x * e1.y);
+	glm::vec3 cross01 = glm::cross(p1 - p0, p2 - p0);
+	float triArea = std::max(glm::length(cross01), 1e-12f);
+
+	float cosine = std::max(std::abs(glm::dot(glm::normalize(dir), cross01 / triArea)), 1e-4f);
+	float footprint = pixelWidth * t / cosine;
+	return std::log2(footprint * std::sqrt(texArea / triArea));
+}
+
+float CpuRaycaster::intersectTri(glm::vec3 origin, glm::vec3 dir, int tri, glm::vec2 *uv)
+{
+	glm::vec3 v0 = positions[indices[tri * 3]];
+	glm::vec3 v0v1 = positions[indices[tri * 3 + 1]] - v0;
+	glm::vec3 v0v2 = positions[indices[tri * 3 + 2]] - v0;
+	glm::vec3 pvec = glm::cross(dir, v0v2);
+	float det = glm::dot(v0v1, pvec);
+
+	if (std::abs(det) < 1e-8f)
+	{
+		return -1;
+	}
+
+	float invDet = 1 / det;
+
+	glm::vec3 tvec = origin - v0;
+	float u = glm::dot(tvec, pvec) * invDet;
+	if (u < 0 || u > 1)
+	{
+		return -1;
+	}
+
+	glm::vec3 qvec = glm::cross(tvec, v0v1);
+	float v = glm::dot(dir, qvec) * invDet;
+	if (v < 0 || u + v > 1)
+	{
+		return -1;
+	}
+
+	*uv = glm::vec2(u, v);
+
+	return glm::dot(v0v2, qvec) * invDet;
+}
+
+glm::vec2 CpuRaycaster::intersectBounds(glm::vec3 origin, glm::vec3 invDir, glm::vec3 bMin, glm::vec3 bMax)
+{
+	glm::vec3 tMin = (bMin - origin) * invDir;
+	glm::vec3 tMax = (bMax - origin) * invDir;
+	glm::vec3 t1 = glm::min(tMin, tMax);
+	glm::vec3 t2 = glm::max(tMin, tMax);
+	float tNear = std::max(std::max(t1.x, t1.y), t1.z);
+	float tFar = std::min(std::min(t2.x, t2.y), t2.z);
+	return glm::vec2(tNear, tFar);
+}
+
+bool CpuRaycaster::intersectTrianglesBVH(glm::vec3 origin, glm::vec3 dir, int *triFound, float *smallest, glm::vec2 *uv)
+{
+	*smallest = MAX_SCENE_BOUNDS;
+	bool found = false;
+	glm::vec3 invDir = 1.0f / dir;
+
+	const BVHNode *bvhNodes = nodes.data();
+	glm::vec2 lambda = intersectBounds(origin, invDir, bvhNodes[0].boundsMin, bvhNodes[0].boundsMax);
+	if (lambda.x > lambda.y || lambda.y < 0)
+	{
+		return false;
+	}
+
+	int stack[BVH_STACK_SIZE];
+	int stackPtr = 0;
+	int nodeIndex = 0;
+
+	while (true)
+	{
+		const BVHNode &node = bvhNodes[nodeIndex];
+		if (node.triCount > 0)
+		{
+			for (int i = node.leftFirst; i < node.leftFirst + node.triCount; i++)
+			{
+				glm::vec2 hitUV;
+				float t = intersectTri(origin, dir, i, &hitUV);
+				if (t >= 0 && t < *smallest)
+				{
+					*smallest = t;
+					*triFound = i;
+					*uv = hitUV;
+					found = true;
+				}
+			}
+		}
+		else
+		{
+			int nearChild = node.leftFirst;
+			int farChild = node.leftFirst + 1;
+			glm::vec2 lambdaNear = intersectBounds(origin, invDir, bvhNodes[nearChild].boundsMin, bvhNodes[nearChild].boundsMax);
+			glm::vec2 lambdaFar = intersectBounds(origin, invDir, bvhNodes[farChild].boundsMin, bvhNodes[farChild].boundsMax);
+			bool hitNear = lambdaNear.x <= lambdaNear.y && lambdaNear.y >= 0 && lambdaNear.x < *smallest;
+			bool hitFar = lambdaFar.x <= lambdaFar.y && lambdaFar.y >= 0 && lambdaFar.x < *smallest;
+
+			if (hitNear && hitFar)
+			{
+				if (lambdaFar.x < lambdaNear.x)
+				{
+					std::swap(nearChild, farChild);
+				}
+
+				stack[stackPtr++] = farChild;
+				nodeIndex = nearChild;
+				continue;
+			}
+			else if (hitNear)
+			{
+				nodeIndex = nearChild;
+				continue;
+			}
+			else if (hitFar)
+			{
+				nodeIndex = farChild;
+				continue;
+			}
+		}
+
+		if (stackPtr == 0)
+		{
+			break;
+		}
+		nodeIndex = stack[--stackPtr];
+	}
+
+	return found;
+}
+
+bool CpuRaycaster::intersectTriangles(glm::vec3 origin, glm::vec3 dir, int *triFound, float *smallest, glm::vec2 *uv)
+{
+	if (!nodes.empty())
+	{
+		return intersectTrianglesBVH(origin, dir, triFound, smallest, uv);
+	}
+
+	*smallest = MAX_SCENE_BOUNDS;
+	bool found = false;
+	for (int i = 0; i < numTriangles; i++)
+	{
+		glm::vec2 hitUV;
+		float t = intersectTri(origin, dir, i, &hitUV);
+		if (t >= 0 && t < *smallest)
+		{
+			*smallest = t;
+			*triFound = i;
+			*uv = hitUV;
+			found = true;
+		}
+	}
+
+	return found;
+}
+
+glm::vec2 CpuRaycaster::intersectCube(glm::vec3 origin, glm::vec3 dir, const cube &c)
+{
+	glm::vec3 tMin = (glm::vec3(c.cubeMin) - origin) / dir;
+	glm::vec3 tMax = (glm::vec3(c.cubeMax) - origin) / dir;
+	glm::vec3 t1 = glm::min(tMin, tMax);
+	glm::vec3 t2 = glm::max(tMin, tMax);
+	float tNear = std::max(std::max(t1.x, t1.y), t1.z);
+	float tFar = std::min(std::min(t2.x, t2.y), t2.z);
+	return glm::vec2(tNear, tFar);
+}
+
+bool CpuRaycaster::intersectCubes(glm::vec3 origin, glm::vec3 dir, HitInfo *info, bool primary)
+{
+	float smallest = MAX_SCENE_BOUNDS;
+	bool found = false;
+	bool visibleOnly = primary && visibleIndices != nullptr;
+	int count = primary ? numCubes : totalCubes;
+	for (int i = 0; i < count; i++)
+	{
+		int index = visibleOnly ? (int)visibleIndices[i] : i;
+		glm::vec2 lambda = intersectCube(origin, dir, cubes[index]);
+		if (lambda.x > 0.0f && lambda.x < lambda.y && lambda.x < smallest)
+		{
+			info->lambda = lambda;
+			info->bi = index;
+			info->cubeMin = glm::vec3(cubes[index].cubeMin);
+			info->cubeMax = glm::vec3(cubes[index].cubeMax);
+			smallest = lambda.x;
+			found = true;
+		}
+	}
+	return found;
+}
+
+bool CpuRaycaster::occludedTrianglesBVH(glm::vec3 origin, glm::vec3 dir, float maxT)
+{
+	glm::vec3 invDir = 1.0f / dir;
+	const BVHNode *bvhNodes = nodes.data();
+	int stack[BVH_STACK_SIZE];
+	int stackPtr = 0;
+	int nodeIndex = 0;
+
+	while (true)
+	{
+		const BVHNode &node = bvhNodes[nodeIndex];
+		glm::vec2 lambda = intersectBounds(origin, invDir, node.boundsMin, node.boundsMax);
+		if (lambda.x <= lambda.y && lambda.y >= 0 && lambda.x < maxT)
+		{
+			if (node.triCount > 0)
+			{
+				for (int i = node.leftFirst; i < node.leftFirst + node.triCount; i++)
+				{
+					glm::vec2 hitUV;
+					float t = intersectTri(origin, dir, i, &hitUV);
+					if (t >= 0 && t < maxT)
+					{
+						return true;
+					}
+				}
+			}
+			else
+			{
+				stack[stackPtr++] = node.leftFirst + 1;
+				nodeIndex = node.leftFirst;
+				continue;
+			}
+		}
+
+		if (stackPtr == 0)
+		{
+			return false;
+		}
+		nodeIndex = stack[--stackPtr];
+	}
+}
+
+bool CpuRaycaster::occludedTriangles(glm::vec3 origin, glm::vec3 dir, float maxT)
+{
+	if (!nodes.empty())
+	{
+		return occludedTrianglesBVH(origin, dir, maxT);
+	}
+
+	for (int i = 0; i < numTriangles; i++)
+	{
+		glm::vec2 hitUV;
+		float t = intersectTri(origin, dir, i, &hitUV);
+		if (t >= 0 && t < maxT)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool CpuRaycaster::occludedCubes(glm::vec3 origin, glm::vec3 dir, float maxT)
+{
+	for (int i = 0; i < totalCubes; i++)
+	{
+		glm::vec2 lambda = intersectCube(origin, dir, cubes[i]);
+		if (lambda.x > 0.0f && lambda.x < lambda.y && lambda.x < maxT)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+bool CpuRaycaster::occluded(glm::vec3 origin, glm::vec3 dir)
+{
+	return occludedCubes(origin, dir, 1.0f) || occludedTriangles(origin, dir, 1.0f);
+}
+
+glm::vec4 CpuRaycaster::sampleTexture(const std::vector<TextureLevel> &levels, glm::vec2 coord, int layer, float lod)
+{
+	//A level of detail at or below zero magnifies, which samples the base level
+	if (!(lod > 0))
+	{
+		return sampleLevel(levels[0], layer, coord);
+	}
+
+	int maxLevel = levels.size() - 1;
+	if (lod >= maxLevel)
+	{
+		return sampleLevel(levels[maxLevel], layer, coord);
+	}
+
+	int level = (int)std::floor(lod);
+	float weight = lod - level;
+	return glm::mix(sampleLevel(levels[level], layer, coord), sampleLevel(levels[level + 1], layer, coord), weight);
+}
+
+glm::vec4 CpuRaycaster::sampleLevel(const TextureLevel &texture, int layer, glm::vec2 coord)
+{
+	glm::vec2 texel = coord * glm::vec2(texture.width, texture.height) - glm::vec2(0.5f);
+	glm::vec2 corner = glm::floor(texel);
+	glm::vec2 weight = texel - corner;
+	glm::ivec2 i = glm::ivec2(corner);
+
+	glm::vec4 bottom = glm::mix(loadTexel(texture, layer, i), loadTexel(texture, layer, i + glm::ivec2(1, 0)), weight.x);
+	glm::vec4 top = glm::mix(loadTexel(texture, layer, i + glm::ivec2(0, 1)), loadTexel(texture, layer, i + glm::ivec2(1, 1)), weight.x);
+	return glm::mix(bottom, top, weight.y);
+}
+
+glm::vec4 CpuRaycaster::loadTexel(const TextureLevel &texture, int layer, glm::ivec2 coord)
+{
+	//GL_REPEAT wraps both ways
+	int x = coord.x % texture.width;
+	int y = coord.y % texture.height;
+	if (x < 0)
+	{
+		x += texture.width;
+	}
+	if (y < 0)
+	{
+		y += texture.height;
+	}
+
+	const float *texel = &texture.texels[((layer * texture.height + y) * texture.width + x) * 4];
+	return glm::vec4(texel[0], texel[1], texel[2], texel[3]);
+}
+
+glm::vec4 CpuRaycaster::trace(glm::vec3 origin, glm::vec3 dir)
+{
+	//Accumulated in the same order as the shade stage of wavefront.csh: every
+	//hit but the last passes REFLECTIVITY of its weight on to its reflection
+	glm::vec4 result = glm::vec4(0);
+	float weight = 1;
+	for (int depth = 0; ; depth++)
+	{
+		glm::vec4 colour = glm::vec4(0.5f, 0.5f, 0.5f, 1.0f);
+		glm::vec3 normal;
+		float t;
+		bool hit = false;
+
+		HitInfo i;
+		int triFound;
+		glm::vec2 uv;
+		if (intersectCubes(origin, dir, &i, depth == 0))
+		{
+			t = i.lambda.x;
+			colour = shadeCube(origin, dir, t, i.bi, &normal);
+			hit = true;
+		}
+		else if (intersectTriangles(origin, dir, &triFound, &t, &uv))
+		{
+			colour = shadeTriangle(origin, dir, triFound, t, uv, &normal);
+			hit = true;
+		}
+
+		if (!hit || depth == reflectionDepth)
+		{
+			return result + weight * colour;
+		}
+
+		result += weight * (1 - REFLECTIVITY) * colour;
+		weight *= REFLECTIVITY;
+		origin = origin + dir * t + normal * SHADOW_BIAS;
+		dir = glm::reflect(dir, normal);
+	}
+}
+
+glm::vec4 CpuRaycaster::shadeCube(glm::vec3 origin, glm::vec3 dir, float lambda, int index, glm::vec3 *normal)
+{
+	glm::vec3 cubeMin = glm::vec3(cubes[index].cubeMin);
+	glm::vec3 cubeMax = glm::vec3(cubes[index].cubeMax);
+	glm::vec3 intersect = origin + dir * lambda;
+	glm::vec3 minResult = glm::abs(cubeMin - intersect);
+	glm::vec3 maxResult = glm::abs(cubeMax - intersect);
+	glm::vec3 faceNormal = glm::vec3(0, 0, 0);
+	if (minResult.x < 0.01f)
+	{
+		faceNormal = glm::vec3(-1, 0, 0);
+	}
+	else if (minResult.y < 0.01f)
+	{
+		faceNormal = glm::vec3(0, -1, 0);
+	}
+	else if (minResult.z < 0.01f)
+	{
+		faceNormal = glm::vec3(0, 0, -1);
+	}
+	else if (maxResult.x < 0.01f)
+	{
+		faceNormal = glm::vec3(1, 0, 0);
+	}
+	else if (maxResult.y < 0.01f)
+	{
+		faceNormal = glm::vec3(0, 1, 0);
+	}
+	else if (maxResult.z < 0.01f)
+	{
+		faceNormal = glm::vec3(0, 0, 1);
+	}
+
+	// Ambient
+	glm::vec3 lightColour = glm::vec3(1, 1, 1);
+	glm::vec3 objectColour = glm::vec3(1, 0, 0);
+	float ambientStrength = 0.3f;
+	glm::vec3 ambient = ambientStrength * lightColour;
+
+	// Diffuse
+	glm::vec3 norm = glm::normalize(faceNormal);
+	glm::vec3 lightDir = glm::normalize(lightPos - intersect);
+	float diff = std::max(glm::dot(norm, lightDir), 0.0f);
+	glm::vec3 diffuse = diff * lightColour;
+
+	glm::vec3 shadowOrigin = intersect + norm * SHADOW_BIAS;
+	if (shadows && diff > 0 && occluded(shadowOrigin, lightPos - shadowOrigin))
+	{
+		diffuse = glm::vec3(0);
+	}
+
+	glm::vec3 result = (ambient + diffuse) * objectColour;
+	*normal = norm;
+	return glm::vec4(result, 1.0f);
+}
+
+glm::vec4 CpuRaycaster::shadeTriangle(glm::vec3 origin, glm::vec3 dir, int tri, float t, glm::vec2 uv, glm::vec3 *normal)
+{
+	glm::vec2 texCoord = getTexCoord(tri, uv);
+	glm::vec3 faceNormal = attributes[indices[tri * 3]].norm;
+	glm::vec3 intersect = origin + dir * t;
+	// Ambient
+	glm::vec3 lightColour = glm::vec3(1, 1, 1);
+	float ambientStrength = 0.3f;
+	glm::vec3 ambient = ambientStrength * lightColour;
+
+	// Diffuse
+	glm::vec3 lightDir = glm::normalize(lightPos - intersect);
+	float diff = std::max(glm::dot(faceNormal, lightDir), 0.0f);
+	glm::vec3 diffuse = diff * lightColour;
+
+	glm::vec3 shadowOrigin = intersect + faceNormal * SHADOW_BIAS;
+	if (shadows && diff > 0 && occluded(shadowOrigin, lightPos - shadowOrigin))
+	{
+		diffuse = glm::vec3(0);
+	}
+
+	glm::vec3 result = glm::clamp(ambient + diffuse, 0.0f, 1.0f);
+	glm::vec4 colour = glm::vec4(result, 1.0f);
+
+	const Material &material = materials[attributes[indices[tri * 3]].material];
+	int array = material.diffuseArray;
+	if (texCoord.x > 0 && array >= 0 && textureArrays != nullptr && array < textureArrays->size() && !(*textureArrays)[array].empty())
+	{
+		const std::vector<TextureLevel> &levels = (*textureArrays)[array];
+		colour = colour * sampleTexture(levels, texCoord, material.diffuseLayer, getTexLod(tri, dir, t, levels));
+	}
+	else
+	{
+		//We don't have texture information so
+		//paint object a nice shade of red
+		colour = colour * glm::vec4(0.8f, 0, 0, 1);
+	}
+
+	*normal = glm::dot(faceNormal, dir) > 0 ? -faceNormal : faceNormal;
+	return colour;
+}
+
+#ifdef CPU_RAYCASTER_SSE
+void CpuRaycaster::renderTilePackets(float *framebuffer, int width, int height, int tileX, int tileY)
+{
+	int lastX = std::min(width, (tileX + 1) * TILE_SIZE);
+	int lastY = std::min(height, (tileY + 1) * TILE_SIZE);
+
+	for (int y = tileY * TILE_SIZE; y < lastY; y += 2)
+	{
+		for (int x = tileX * TILE_SIZE; x < lastX; x += 2)
+		{
+			//Lanes past the edge of the image repeat the last pixel and are not written
+			glm::vec3 origins[4];
+			glm::vec3 dirs[4];
+			for (int lane = 0; lane < 4; lane++)
+			{
+				int px = std::min(x + PACKET_X[lane], lastX - 1);
+				int py = std::min(y + PACKET_Y[lane], lastY - 1);
+				origins[lane] = eye;
+				dirs[lane] = getEyeRay(px, py, width, height);
+			}
+
+			glm::vec4 colours[4];
+			tracePacket(origins, dirs, colours);
+
+			for (int lane = 0; lane < 4; lane++)
+			{
+				int px = x + PACKET_X[lane];
+				int py = y + PACKET_Y[lane];
+				if (px >= lastX || py >= lastY)
+				{
+					continue;
+				}
+
+				float *pixel = &framebuffer[(py * width + px) * 4];
+				pixel[0] = colours[lane].x;
+				pixel[1] = colours[lane].y;
+				pixel[2] = colours[lane].z;
+				pixel[3] = colours[lane].w;
+			}
+		}
+	}
+}
+
+void CpuRaycaster::tracePacket(const glm::vec3 origins[4], const glm::vec3 dirs[4], glm::vec4 colours[4])
+{
+	RayPacket rays;
+	rays.ox = _mm_setr_ps(origins[0].x, origins[1].x, origins[2].x, origins[3].x);
+	rays.oy = _mm_setr_ps(origins[0].y, origins[1].y, origins[2].y, origins[3].y);
+	rays.oz = _mm_setr_ps(origins[0].z, origins[1].z, origins[2].z, origins[3].z);
+	rays.dx = _mm_setr_ps(dirs[0].x, dirs[1].x, dirs[2].x, dirs[3].x);
+	rays.dy = _mm_setr_ps(dirs[0].y, dirs[1].y, dirs[2].y, dirs[3].y);
+	rays.dz = _mm_setr_ps(dirs[0].z, dirs[1].z, dirs[2].z, dirs[3].z);
+
+	//Lanes that hit a cube are done, as in trace
+	float lambda[4];
+	int cubeIndex[4];
+	int cubeMask = intersectCubesPacket(rays, lambda, cubeIndex);
+
+	int triMask = 0;
+	PacketHit hit;
+	hit.t = _mm_set1_ps(MAX_SCENE_BOUNDS);
+	hit.u = _mm_setzero_ps();
+	hit.v = _mm_setzero_ps();
+	hit.tri = _mm_set1_epi32(-1);
+	if (cubeMask != 0xF)
+	{
+		__m128i laneBits = _mm_setr_epi32(1, 2, 4, 8);
+		__m128 active = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(~cubeMask), laneBits), laneBits));
+		intersectTrianglesPacket(rays, active, &hit);
+		triMask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(hit.tri, _mm_set1_epi32(-1))));
+	}
+
+	float t[4];
+	float u[4];
+	float v[4];
+	int tri[4];
+	_mm_storeu_ps(t, hit.t);
+	_mm_storeu_ps(u, hit.u);
+	_mm_storeu_ps(v, hit.v);
+	_mm_storeu_si128((__m128i*)tri, hit.tri);
+
+	//Packets are only traced without reflections, so the normals aren't needed
+	glm::vec3 normal;
+	for (int lane = 0; lane < 4; lane++)
+	{
+		if (cubeMask & (1 << lane))
+		{
+			colours[lane] = shadeCube(origins[lane], dirs[lane], lambda[lane], cubeIndex[lane], &normal);
+		}
+		else if (triMask & (1 << lane))
+		{
+			colours[lane] = shadeTriangle(origins[lane], dirs[lane], tri[lane], t[lane], glm::vec2(u[lane], v[lane]), &normal);
+		}
+		else
+		{
+			colours[lane] = glm::vec4(0.5f, 0.5f, 0.5f, 1.0f);
+		}
+	}
+}
+
+int CpuRaycaster::intersectCubesPacket(const RayPacket &rays, float lambda[4], int index[4])
+{
+	__m128 smallest = _mm_set1_ps(MAX_SCENE_BOUNDS);
+	__m128i best = _mm_set1_epi32(-1);
+	__m128 found = _mm_setzero_ps();
+	__m128 zero = _mm_setzero_ps();
+
+	for (int i = 0; i < numCubes; i++)
+	{
+		int cubeIndex = visibleIndices != nullptr ? (int)visibleIndices[i] : i;
+		const cube &c = cubes[cubeIndex];
+
+		__m128 tMinX = _mm_div_ps(_mm_sub_ps(_mm_set1_ps(c.cubeMin.x), rays.ox), rays.dx);
+		__m128 tMinY = _mm_div_ps(_mm_sub_ps(_mm_set1_ps(c.cubeMin.y), rays.oy), rays.dy);
+		__m128 tMinZ = _mm_div_ps(_mm_sub_ps(_mm_set1_ps(c.cubeMin.z), rays.oz), rays.dz);
+		__m128 tMaxX = _mm_div_ps(_mm_sub_ps(_mm_set1_ps(c.cubeMax.x), rays.ox), rays.dx);
+		__m128 tMaxY = _mm_div_ps(_mm_sub_ps(_mm_set1_ps(c.cubeMax.y), rays.oy), rays.dy);
+		__m128 tMaxZ = _mm_div_ps(_mm_sub_ps(_mm_set1_ps(c.cubeMax.z), rays.oz), rays.dz);
+
+		__m128 tNear = maxLanes(maxLanes(minLanes(tMinX, tMaxX), minLanes(tMinY, tMaxY)), minLanes(tMinZ, tMaxZ));
+		__m128 tFar = minLanes(minLanes(maxLanes(tMinX, tMaxX), maxLanes(tMinY, tMaxY)), maxLanes(tMinZ, tMaxZ));
+
+		__m128 closer = _mm_and_ps(_mm_and_ps(_mm_cmpgt_ps(tNear, zero), _mm_cmplt_ps(tNear, tFar)), _mm_cmplt_ps(tNear, smallest));
+		if (_mm_movemask_ps(closer) == 0)
+		{
+			continue;
+		}
+
+		smallest = selectLanes(closer, tNear, smallest);
+		best = selectLanes(closer, _mm_set1_epi32(cubeIndex), best);
+		found = _mm_or_ps(found, closer);
+	}
+
+	_mm_storeu_ps(lambda, smallest);
+	_mm_storeu_si128((__m128i*)index, best);
+	return _mm_movemask_ps(found);
+}
+
+void CpuRaycaster::intersectTriPacket(const RayPacket &rays, __m128 active, int triIndex, PacketHit *hit)
+{
+	//Edges are computed once per triangle exactly as intersectTri does, then broadcast
+	glm::vec3 v0 = positions[indices[triIndex * 3]];
+	glm::vec3 v0v1 = positions[indices[triIndex * 3 + 1]] - v0;
+	glm::vec3 v0v2 = positions[indices[triIndex * 3 + 2]] - v0;
+
+	__m128 e1x = _mm_set1_ps(v0v1.x), e1y = _mm_set1_ps(v0v1.y), e1z = _mm_set1_ps(v0v1.z);
+	__m128 e2x = _mm_set1_ps(v0v2.x), e2y = _mm_set1_ps(v0v2.y), e2z = _mm_set1_ps(v0v2.z);
+
+	//pvec = cross(dir, v0v2)
+	__m128 px = _mm_sub_ps(_mm_mul_ps(rays.dy, e2z), _mm_mul_ps(rays.dz, e2y));
+	__m128 py = _mm_sub_ps(_mm_mul_ps(rays.dz, e2x), _mm_mul_ps(rays.dx, e2z));
+	__m128 pz = _mm_sub_ps(_mm_mul_ps(rays.dx, e2y), _mm_mul_ps(rays.dy, e2x));
+	__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+
+	__m128 absDet = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+	__m128 valid = _mm_and_ps(active, _mm_cmpnlt_ps(absDet, _mm_set1_ps(1e-8f)));
+	if (_mm_movemask_ps(valid) == 0)
+	{
+		return;
+	}
+
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 zero = _mm_setzero_ps();
+	__m128 invDet = _mm_div_ps(one, det);
+
+	__m128 tx = _mm_sub_ps(rays.ox, _mm_set1_ps(v0.x));
+	__m128 ty = _mm_sub_ps(rays.oy, _mm_set1_ps(v0.y));
+	__m128 tz = _mm_sub_ps(rays.oz, _mm_set1_ps(v0.z));
+	__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), invDet);
+	valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpnlt_ps(u, zero), _mm_cmpngt_ps(u, one)));
+	if (_mm_movemask_ps(valid) == 0)
+	{
+		return;
+	}
+
+	//qvec = cross(tvec, v0v1)
+	__m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+	__m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+	__m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+	__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(rays.dx, qx), _mm_mul_ps(rays.dy, qy)), _mm_mul_ps(rays.dz, qz)), invDet);
+	valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpnlt_ps(v, zero), _mm_cmpngt_ps(_mm_add_ps(u, v), one)));
+
+	__m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+	__m128 closer = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(t, zero), _mm_cmplt_ps(t, hit->t)));
+	if (_mm_movemask_ps(closer) == 0)
+	{
+		return;
+	}
+
+	hit->t = selectLanes(closer, t, hit->t);
+	hit->u = selectLanes(closer, u, hit->u);
+	hit->v = selectLanes(closer, v, hit->v);
+	hit->tri = selectLanes(closer, _mm_set1_epi32(triIndex), hit->tri);
+}
+
+void CpuRaycaster::intersectBoundsPacket(const RayPacket &rays, __m128 invX, __m128 invY, __m128 invZ, const BVHNode &node, __m128 *tNear, __m128 *tFar)
+{
+	__m128 tMinX = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.boundsMin.x), rays.ox), invX);
+	__m128 tMinY = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.boundsMin.y), rays.oy), invY);
+	__m128 tMinZ = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.boundsMin.z), rays.oz), invZ);
+	__m128 tMaxX = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.boundsMax.x), rays.ox), invX);
+	__m128 tMaxY = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.boundsMax.y), rays.oy), invY);
+	__m128 tMaxZ = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.boundsMax.z), rays.oz), invZ);
+
+	*tNear = maxLanes(maxLanes(minLanes(tMinX, tMaxX), minLanes(tMinY, tMaxY)), minLanes(tMinZ, tMaxZ));
+	*tFar = minLanes(minLanes(maxLanes(tMinX, tMaxX), maxLanes(tMinY, tMaxY)), maxLanes(tMinZ, tMaxZ));
+}
+
+void CpuRaycaster::intersectTrianglesBVHPacket(const RayPacket &rays, __m128 active, PacketHit *hit)
+{
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 zero = _mm_setzero_ps();
+	__m128 invX = _mm_div_ps(one, rays.dx);
+	__m128 invY = _mm_div_ps(one, rays.dy);
+	__m128 invZ = _mm_div_ps(one, rays.dz);
+
+	const BVHNode *bvhNodes = nodes.data();
+	__m128 tNear, tFar;
+	intersectBoundsPacket(rays, invX, invY, invZ, bvhNodes[0], &tNear, &tFar);
+	active = _mm_and_ps(active, _mm_and_ps(_mm_cmpngt_ps(tNear, tFar), _mm_cmpnlt_ps(tFar, zero)));
+	if (_mm_movemask_ps(active) == 0)
+	{
+		return;
+	}
+
+	//A node is visited while any active lane still hits it closer than its best hit
+	int stack[BVH_STACK_SIZE];
+	int stackPtr = 0;
+	int nodeIndex = 0;
+
+	while (true)
+	{
+		const BVHNode &node = bvhNodes[nodeIndex];
+		if (node.triCount > 0)
+		{
+			for (int i = node.leftFirst; i < node.leftFirst + node.triCount; i++)
+			{
+				intersectTriPacket(rays, active, i, hit);
+			}
+		}
+		else
+		{
+			int nearChild = node.leftFirst;
+			int farChild = node.leftFirst + 1;
+			__m128 nearIn, nearOut, farIn, farOut;
+			intersectBoundsPacket(rays, invX, invY, invZ, bvhNodes[nearChild], &nearIn, &nearOut);
+			intersectBoundsPacket(rays, invX, invY, invZ, bvhNodes[farChild], &farIn, &farOut);
+			__m128 hitNear = _mm_and_ps(active, _mm_and_ps(_mm_and_ps(_mm_cmple_ps(nearIn, nearOut), _mm_cmpge_ps(nearOut, zero)), _mm_cmplt_ps(nearIn, hit->t)));
+			__m128 hitFar = _mm_and_ps(active, _mm_and_ps(_mm_and_ps(_mm_cmple_ps(farIn, farOut), _mm_cmpge_ps(farOut, zero)), _mm_cmplt_ps(farIn, hit->t)));
+			int nearMask = _mm_movemask_ps(hitNear);
+			int farMask = _mm_movemask_ps(hitFar);
+
+			if (nearMask != 0 && farMask != 0)
+			{
+				//Go down whichever child most of the lanes that hit both reach first
+				int bothMask = nearMask & farMask;
+				int farFirstMask = bothMask & _mm_movemask_ps(_mm_cmplt_ps(farIn, nearIn));
+				if (countLanes(farFirstMask) * 2 > countLanes(bothMask))
+				{
+					std::swap(nearChild, farChild);
+				}
+
+				stack[stackPtr++] = farChild;
+				nodeIndex = nearChild;
+				continue;
+			}
+			else if (nearMask != 0)
+			{
+				nodeIndex = nearChild;
+				continue;
+			}
+			else if (farMask != 0)
+			{
+				nodeIndex = farChild;
+				continue;
+			}
+		}
+
+		if (stackPtr == 0)
+		{
+			break;
+		}
+		nodeIndex = stack[--stackPtr];
+	}
+}
+
+void CpuRaycaster::intersectTrianglesPacket(const RayPacket &rays, __m128 active, PacketHit *hit)
+{
+	if (!nodes.empty())
+	{
+		intersectTrianglesBVHPacket(rays, active, hit);
+		return;
+	}
+
+	for (int i = 0; i < numTriangles; i++)
+	{
+		intersectTriPacket(rays, active, i, hit);
+	}
+}
+#endif
+
+CpuRaycaster::~CpuRaycaster()
+{
+}
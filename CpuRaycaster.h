@@ -0,0 +1,159 @@
+#pragma once
+
+#include <vector>
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CPU_RAYCASTER_SSE
+#endif
+
+#include "ArrayView.h"
+#include "Model.h"
+#include "BVH.h"
+#include "ThreadPool.h"
+
+//One mip level of one of the model's texture arrays as RGBA floats, read back from
+//the GPU with the layers one after another
+struct TextureLevel {
+	std::vector<float> texels;
+	int width;
+	int height;
+	int layers;
+};
+
+//Laid out to match the std430 cube struct in raycast.csh
+struct cube {
+	glm::vec4 cubeMin;
+	glm::vec4 cubeMax;
+};
+
+//C++ port of trace, intersectCubes and intersectTriangles from the compute shader.
+//It renders the same image as the compute shader on the CPU, splitting the
+//framebuffer into tiles that are run across the thread pool. Every function
+//follows its GLSL counterpart operation for operation so the output can be
+//compared against the GPU when the shader changes; the GPU may still contract
+//to fused multiply-adds, so comparisons should allow a small tolerance.
+//With SSE the primary rays are traced as 2x2 packets, one ray per lane. The
+//lanes run the same operations as the scalar path so both produce the same image.
+class CpuRaycaster
+{
+	public:
+		CpuRaycaster(ThreadPool *pool);
+		~CpuRaycaster();
+
+		//visibleIndices mirrors USE_VISIBLE_CUBES, pass nullptr to test every cube
+		void setCubes(const cube *cubes, int numCubes, const GLuint *visibleIndices, int numVisible);
+		//nodes mirrors USE_BVH, pass an empty tree for the linear path. The arrays must outlive rendering
+		void setTriangles(ArrayView<glm::vec3> positions, ArrayView<VertexAttributes> attributes, ArrayView<GLuint> indices, ArrayView<BVHNode> nodes);
+		//Indexed by VertexAttributes::material, the equivalent of materialData
+		void setMaterials(ArrayView<Material> materials);
+		//Mip chain of each of the model's texture arrays, the equivalent of modelTex. Pass nullptr for none
+		void setTextures(const std::vector<std::vector<TextureLevel>> *arrays);
+		void setCamera(glm::vec3 eye, glm::vec3 ray00, glm::vec3 ray01, glm::vec3 ray10, glm::vec3 ray11, glm::vec3 lightPos);
+		//Packets are on by default where SSE is available, off forces the scalar path
+		void setPacketTracing(bool enabled);
+		//Mirrors SHADOWS, the shadow rays are traced straight after the hit rather than in a second pass
+		void setShadows(bool enabled);
+		//Reflections each hit follows, the equivalent of REFLECTION_DEPTH in wavefront.csh.
+		//Above 0 the scalar path is always used
+		void setReflectionDepth(int depth);
+
+		//Writes width * height RGBA floats, row 0 at the bottom as in the framebuffer texture
+		void render(float *framebuffer, int width, int height);
+		glm::vec4 trace(glm::vec3 origin, glm::vec3 dir);
+
+	protected:
+		static const int TILE_SIZE = 16;
+
+		struct HitInfo {
+			glm::vec2 lambda;
+			glm::vec3 cubeMin;
+			glm::vec3 cubeMax;
+			int bi;
+		};
+
+		void renderTile(float *framebuffer, int width, int height, int tileX, int tileY);
+		glm::vec3 getEyeRay(int x, int y, int width, int height);
+
+		//normal is set to the surface normal facing the ray, for the reflection
+		glm::vec4 shadeCube(glm::vec3 origin, glm::vec3 dir, float lambda, int index, glm::vec3 *normal);
+		glm::vec4 shadeTriangle(glm::vec3 origin, glm::vec3 dir, int tri, float t, glm::vec2 uv, glm::vec3 *normal);
+		glm::vec2 getTexCoord(int tri, glm::vec2 uv);
+		float getTexLod(int tri, glm::vec3 dir, float t, const std::vector<TextureLevel> &levels);
+
+		float intersectTri(glm::vec3 origin, glm::vec3 dir, int tri, glm::vec2 *uv);
+		glm::vec2 intersectBounds(glm::vec3 origin, glm::vec3 invDir, glm::vec3 bMin, glm::vec3 bMax);
+		bool intersectTrianglesBVH(glm::vec3 origin, glm::vec3 dir, int *triFound, float *smallest, glm::vec2 *uv);
+		bool intersectTriangles(glm::vec3 origin, glm::vec3 dir, int *triFound, float *smallest, glm::vec2 *uv);
+		glm::vec2 intersectCube(glm::vec3 origin, glm::vec3 dir, const cube &c);
+		//Only primary rays keep to the visible cubes, reflections test all of them
+		bool intersectCubes(glm::vec3 origin, glm::vec3 dir, HitInfo *info, bool primary);
+		bool occludedTrianglesBVH(glm::vec3 origin, glm::vec3 dir, float maxT);
+		bool occludedTriangles(glm::vec3 origin, glm::vec3 dir, float maxT);
+		bool occludedCubes(glm::vec3 origin, glm::vec3 dir, float maxT);
+		bool occluded(glm::vec3 origin, glm::vec3 dir);
+		//Trilinear textureLod with GL_REPEAT, as the sampler in raycast.csh
+		glm::vec4 sampleTexture(const std::vector<TextureLevel> &levels, glm::vec2 coord, int layer, float lod);
+		glm::vec4 sampleLevel(const TextureLevel &texture, int layer, glm::vec2 coord);
+		glm::vec4 loadTexel(const TextureLevel &texture, int layer, glm::ivec2 coord);
+
+#ifdef CPU_RAYCASTER_SSE
+		//One ray per lane, stored as structure of arrays
+		struct RayPacket {
+			__m128 ox, oy, oz;
+			__m128 dx, dy, dz;
+		};
+
+		//Closest triangle hit per lane, tri is -1 for lanes that missed
+		struct PacketHit {
+			__m128 t;
+			__m128 u;
+			__m128 v;
+			__m128i tri;
+		};
+
+		void renderTilePackets(float *framebuffer, int width, int height, int tileX, int tileY);
+		void tracePacket(const glm::vec3 origins[4], const glm::vec3 dirs[4], glm::vec4 colours[4]);
+
+		int intersectCubesPacket(const RayPacket &rays, float lambda[4], int index[4]);
+		void intersectTriPacket(const RayPacket &rays, __m128 active, int triIndex, PacketHit *hit);
+		void intersectBoundsPacket(const RayPacket &rays, __m128 invX, __m128 invY, __m128 invZ, const BVHNode &node, __m128 *tNear, __m128 *tFar);
+		void intersectTrianglesBVHPacket(const RayPacket &rays, __m128 active, PacketHit *hit);
+		void intersectTrianglesPacket(const RayPacket &rays, __m128 active, PacketHit *hit);
+#endif
+
+		bool usePackets;
+		bool shadows;
+		int reflectionDepth;
+
+		ThreadPool *pool;
+
+		const cube *cubes;
+		int numCubes;
+		const GLuint *visibleIndices;
+		//Every cube, visible or not, can cast a shadow
+		int totalCubes;
+
+		ArrayView<glm::vec3> positions;
+		ArrayView<VertexAttributes> attributes;
+		ArrayView<GLuint> indices;
+		int numTriangles;
+		ArrayView<BVHNode> nodes;
+		ArrayView<Material> materials;
+
+		const std::vector<std::vector<TextureLevel>> *textureArrays;
+
+		glm::vec3 eye;
+		glm::vec3 ray00;
+		glm::vec3 ray01;
+		glm::vec3 ray10;
+		glm::vec3 ray11;
+		glm::vec3 lightPos;
+		//pixelWidth in raycast.csh, set for each render
+		float pixelWidth;
+
+};
@@ -0,0 +1,71 @@
+#include "Frustum.h"
+
+
+Frustum::Frustum()
+{
+	for (int i = 0; i < NUM_PLANES; i++)
+	{
+		planes[i] = glm::vec4(0, 0, 0, 1);
+	}
+}
+
+Frustum::Frustum(glm::mat4 vp)
+{
+	//glm is column major so row i of the matrix is (m[0][i], m[1][i], m[2][i], m[3][i])
+	glm::vec4 row0 = glm::vec4(vp[0][0], vp[1][0], vp[2][0], vp[3][0]);
+	glm::vec4 row1 = glm::vec4(vp[0][1], vp[1][1], vp[2][1], vp[3][1]);
+	glm::vec4 row3 = glm::vec4(vp[0][3], vp[1][3], vp[2][3], vp[3][3]);
+
+	planes[0] = row3 + row0; //Left
+	planes[1] = row3 - row0; //Right
+	planes[2] = row3 + row1; //Bottom
+	planes[3] = row3 - row1; //Top
+
+	for (int i = 0; i < NUM_PLANES; i++)
+	{
+		planes[i] = planes[i] * (1.0f / glm::length(glm::vec3(planes[i])));
+	}
+}
+
+Frustum::Classification Frustum::classify(glm::vec3 boundsMin, glm::vec3 boundsMax) const
+{
+	Classification result = INSIDE;
+	for (int i = 0; i < NUM_PLANES; i++)
+	{
+		glm::vec3 normal = glm::vec3(planes[i]);
+
+		//The corner furthest along the plane normal decides if the box is outside,
+		//the corner furthest against it decides if the box is fully inside
+		glm::vec3 positive = boundsMin;
+		glm::vec3 negative = boundsMax;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			if (normal[axis] >= 0)
+			{
+				positive[axis] = boundsMax[axis];
+				negative[axis] = boundsMin[axis];
+			}
+		}
+
+		if (glm::dot(normal, positive) + planes[i].w < 0)
+		{
+			return OUTSIDE;
+		}
+
+		if (glm::dot(normal, negative) + planes[i].w < 0)
+		{
+			result = INTERSECTING;
+		}
+	}
+
+	return result;
+}
+
+bool Frustum::intersects(glm::vec3 boundsMin, glm::vec3 boundsMax) const
+{
+	return classify(boundsMin, boundsMax) != OUTSIDE;
+}
+
+Frustum::~Frustum()
+{
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+//View frustum planes extracted from a view-projection matrix (Gribb/Hartmann).
+//Each plane is stored as (normal, d) with the normal pointing into the frustum.
+class Frustum
+{
+	public:
+		enum Classification { OUTSIDE, INTERSECTING, INSIDE };
+
+		Frustum();
+		Frustum(glm::mat4 vp);
+		~Frustum();
+
+		Classification classify(glm::vec3 boundsMin, glm::vec3 boundsMax) const;
+		bool intersects(glm::vec3 boundsMin, glm::vec3 boundsMax) const;
+
+	protected:
+		//The compute shader casts rays from the eye out to MAX_SCENE_BOUNDS, not
+		//between the projection's near and far planes, so only the four side
+		//planes bound what it can actually see.
+		static const int NUM_PLANES = 4;
+
+		glm::vec4 planes[NUM_PLANES];
+
+};
@@ -1,9 +1,51 @@
 #include "Model.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 
-Model::Model(std::string path)
+//Stands in for a texture that fails to decode, so its layer isn't left undefined
+static const unsigned char WHITE_TEXEL[4] = { 255, 255, 255, 255 };
+
+Model::Model()
+{
+	pool = nullptr;
+	nextUpload = 0;
+	texturesReady = false;
+	stretchFramebuffers[0] = 0;
+	stretchFramebuffers[1] = 0;
+}
+
+Model::Model(std::string path, ThreadPool *pool)
+{
+	this->pool = nullptr;
+	nextUpload = 0;
+	texturesReady = false;
+	stretchFramebuffers[0] = 0;
+	stretchFramebuffers[1] = 0;
+	this->loadModel(path, pool);
+}
+
+//Assimp matrices are row major, glm is column major
+static glm::mat4 toMat4(const aiMatrix4x4 &m)
 {
-	this->loadModel(path);
+	glm::mat4 result;
+	result[0] = glm::vec4(m.a1, m.b1, m.c1, m.d1);
+	result[1] = glm::vec4(m.a2, m.b2, m.c2, m.d2);
+	result[2] = glm::vec4(m.a3, m.b3, m.c3, m.d3);
+	result[3] = glm::vec4(m.a4, m.b4, m.c4, m.d4);
+	return result;
+}
+
+//Faces with fewer than 3 indices are lines or points and are skipped
+static GLuint countTriangleIndices(const aiMesh* mesh)
+{
+	GLuint count = 0;
+	for (int i = 0; i < mesh->mNumFaces; i++)
+	{
+		count += mesh->mFaces[i].mNumIndices / 3 * 3;
+	}
+	return count;
 }
 
 // Checks all material textures of a given type and loads the textures if they're not loaded yet.
@@ -39,11 +81,11 @@ std::vector<Texture> Model::loadMaterialTextures(aiMaterial* mat, aiTextureType
 	return textures;
 }
 
-void Model::loadModel(std::string path)
+void Model::loadModel(std::string path, ThreadPool *pool)
 {
 	// Read file via ASSIMP
 	Assimp::Importer importer;
-	const aiScene* scene = importer.ReadFile(path, aiProcess_Triangulate | aiProcess_FlipUVs);
+	const aiScene* scene = importer.ReadFile(path, aiProcess_Triangulate | aiProcess_JoinIdenticalVertices | aiProcess_FlipUVs);
 	// Check for errors
 	if (!scene || scene->mFlags == AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode) // if is Not Zero
 	{
@@ -52,137 +94,532 @@ void Model::loadModel(std::string path)
 	}
 	// Retrieve the directory path of the filepath
 	this->directory = path.substr(0, path.find_last_of('/'));
+	this->pool = pool;
 
-	// Process ASSIMP's root node recursively
-	this->processModel(scene, scene->mRootNode);
+	//Textures start decoding before the meshes are converted
+	for (int i = 0; i < scene->mNumMaterials; i++)
+	{
+		materials.push_back(this->processMaterial(scene->mMaterials[i]));
+	}
+
+	//First pass walks the node tree to place every mesh and size the buffers
+	std::vector<MeshInstance> instances;
+	this->processModel(scene, scene->mRootNode, glm::mat4(1.0f), &instances);
+
+	vertexPositions.resize(instances.size() > 0 ? instances.back().firstVertex + instances.back().mesh->mNumVertices : 0);
+	vertexAttributes.resize(vertexPositions.size());
+	indices.resize(instances.size() > 0 ? instances.back().firstIndex + countTriangleIndices(instances.back().mesh) : 0);
+
+	//Second pass converts the meshes into their own ranges, so they can run in parallel
+	if (pool != nullptr)
+	{
+		pool->parallelFor(0, instances.size(), 1, [this, &instances](int first, int last)
+		{
+			for (int i = first; i < last; i++)
+			{
+				this->processMesh(instances[i]);
+			}
+		});
+	}
+	else
+	{
+		for (int i = 0; i < instances.size(); i++)
+		{
+			this->processMesh(instances[i]);
+		}
+	}
 }
 
-void Model::processMaterial(aiMesh* mesh, const aiScene* scene, std::vector<Texture> *textures)
+void Model::loadTextures(std::string path, std::vector<Texture> textures, ThreadPool *pool)
 {
-	// Process materials
-	if (mesh->mMaterialIndex >= 0)
-	{
-		aiMaterial* material = scene->mMaterials[mesh->mMaterialIndex];
-		// We assume a convention for sampler names in the shaders. Each diffuse texture should be named
-		// as 'texture_diffuseN' where N is a sequential number ranging from 1 to MAX_SAMPLER_NUMBER. 
-		// Same applies to other texture as the following list summarizes:
-		// Diffuse: texture_diffuseN
-		// Specular: texture_specularN
-		// Normal: texture_normalN
+	this->directory = path.substr(0, path.find_last_of('/'));
+	this->pool = pool;
 
-		// 1. Diffuse maps
-		std::vector<Texture> diffuseMaps = this->loadMaterialTextures(material, aiTextureType_DIFFUSE, "texture_diffuse", directory);
-		textures->insert(textures->end(), diffuseMaps.begin(), diffuseMaps.end());
-		// 2. Specular maps
-		std::vector<Texture> specularMaps = this->loadMaterialTextures(material, aiTextureType_SPECULAR, "texture_specular", directory);
-		textures->insert(textures->end(), specularMaps.begin(), specularMaps.end());
+	for (int i = 0; i < textures.size(); i++)
+	{
+		Texture texture = textures[i];
+		texture.id = this->loadTextureFromFile(texture.path.C_Str());
+		texturesLoaded.push_back(texture);
 	}
 }
 
-void Model::processMesh(aiMesh* mesh)
+Material Model::processMaterial(aiMaterial* material)
 {
-	for (int i = 0; i < mesh->mNumFaces; i++)
+	//Only diffuse maps are sampled, the first one is used for the material
+	Material result;
+	result.diffuseTexture = -1;
+	result.diffuseArray = -1;
+	result.diffuseLayer = -1;
+
+	std::vector<Texture> diffuseMaps = this->loadMaterialTextures(material, aiTextureType_DIFFUSE, "texture_diffuse", directory);
+	if (diffuseMaps.size() > 0)
 	{
-		aiFace face = mesh->mFaces[i];
-		for (int j = 0; j < face.mNumIndices; j += 3)
-		{
-			glm::vec4 vec0;
-			glm::vec4 vec1;
-			glm::vec4 vec2;
-			glm::vec4 norm = glm::vec4(1, 1, 1, 1);
-			glm::vec4 tex0 = glm::vec4(-1, -1, -1, -1);
-			glm::vec4 tex1 = glm::vec4(-1, -1, -1, -1);
-			glm::vec4 tex2 = glm::vec4(-1, -1, -1, -1);
+		result.diffuseTexture = diffuseMaps[0].id;
+	}
 
-			vec0.x = mesh->mVertices[face.mIndices[j]].x;
-			vec0.y = mesh->mVertices[face.mIndices[j]].y;
-			vec0.z = mesh->mVertices[face.mIndices[j]].z;
+	return result;
+}
 
-			vec1.x = mesh->mVertices[face.mIndices[j + 1]].x;
-			vec1.y = mesh->mVertices[face.mIndices[j + 1]].y;
-			vec1.z = mesh->mVertices[face.mIndices[j + 1]].z;
+void Model::processMesh(const MeshInstance &instance)
+{
+	aiMesh* mesh = instance.mesh;
+	bool transformed = instance.transform != glm::mat4(1.0f);
+	glm::mat3 normalTransform = glm::transpose(glm::inverse(glm::mat3(instance.transform)));
 
-			vec2.x = mesh->mVertices[face.mIndices[j + 2]].x;
-			vec2.y = mesh->mVertices[face.mIndices[j + 2]].y;
-			vec2.z = mesh->mVertices[face.mIndices[j + 2]].z;
+	for (int i = 0; i < mesh->mNumVertices; i++)
+	{
+		glm::vec3 pos = glm::vec3(mesh->mVertices[i].x, mesh->mVertices[i].y, mesh->mVertices[i].z);
 
-			if (mesh->HasNormals())
-			{
-				norm.x = mesh->mNormals[face.mIndices[j]].x;
-				norm.y = mesh->mNormals[face.mIndices[j]].y;
-				norm.z = mesh->mNormals[face.mIndices[j]].z;
-			}
+		VertexAttributes attrib;
+		attrib.norm = glm::vec3(1, 1, 1);
+		attrib.tex = glm::vec2(-1, -1);
 
-			if (mesh->mTextureCoords[0]) // Does the mesh contain texture coordinates?
+		if (mesh->HasNormals())
+		{
+			attrib.norm = glm::vec3(mesh->mNormals[i].x, mesh->mNormals[i].y, mesh->mNormals[i].z);
+			if (transformed)
 			{
-				tex0.x = mesh->mTextureCoords[0][face.mIndices[j]].x;
-				tex0.y = mesh->mTextureCoords[0][face.mIndices[j]].y;
+				attrib.norm = glm::normalize(normalTransform * attrib.norm);
+			}
+		}
 
-				tex1.x = mesh->mTextureCoords[0][face.mIndices[j + 1]].x;
-				tex1.y = mesh->mTextureCoords[0][face.mIndices[j + 1]].y;
+		if (mesh->mTextureCoords[0]) // Does the mesh contain texture coordinates?
+		{
+			attrib.tex = glm::vec2(mesh->mTextureCoords[0][i].x, mesh->mTextureCoords[0][i].y);
+		}
+		attrib.material = mesh->mMaterialIndex;
 
-				tex2.x = mesh->mTextureCoords[0][face.mIndices[j + 2]].x;
-				tex2.y = mesh->mTextureCoords[0][face.mIndices[j + 2]].y;
+		if (transformed)
+		{
+			pos = glm::vec3(instance.transform * glm::vec4(pos, 1.0f));
+		}
 
-			}
+		vertexPositions[instance.firstVertex + i] = pos;
+		vertexAttributes[instance.firstVertex + i] = attrib;
+	}
 
-			modelTris.push_back({ vec0, vec1, vec2, norm, tex0, tex1, tex2});
+	//Indices in the mesh are relative to its own vertices
+	GLuint *out = &indices[instance.firstIndex];
+	for (int i = 0; i < mesh->mNumFaces; i++)
+	{
+		const aiFace &face = mesh->mFaces[i];
+		for (int j = 0; j + 2 < face.mNumIndices; j += 3)
+		{
+			*out++ = instance.firstVertex + face.mIndices[j];
+			*out++ = instance.firstVertex + face.mIndices[j + 1];
+			*out++ = instance.firstVertex + face.mIndices[j + 2];
 		}
 	}
 }
 
-void Model::processModel(const aiScene* scene, aiNode* node)
+void Model::processModel(const aiScene* scene, aiNode* node, glm::mat4 parentTransform, std::vector<MeshInstance> *instances)
 {
-	//Normally we would store the textures per mesh,
-	//but we have a limitation of 1 texture per model atm
-	std::vector<Texture> textures;
+	glm::mat4 transform = parentTransform * toMat4(node->mTransformation);
+
 	for (int i = 0; i < node->mNumMeshes; i++)
 	{
-		aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
-		this->processMesh(mesh);
-		this->processMaterial(mesh, scene, &textures);
+		MeshInstance instance;
+		instance.mesh = scene->mMeshes[node->mMeshes[i]];
+		instance.transform = transform;
+		instance.firstVertex = 0;
+		instance.firstIndex = 0;
+		if (instances->size() > 0)
+		{
+			const MeshInstance &previous = instances->back();
+			instance.firstVertex = previous.firstVertex + previous.mesh->mNumVertices;
+			instance.firstIndex = previous.firstIndex + countTriangleIndices(previous.mesh);
+		}
+		instances->push_back(instance);
 	}
 
 	for (int i = 0; i < node->mNumChildren; i++)
 	{
-		this->processModel(scene, node->mChildren[i]);
+		this->processModel(scene, node->mChildren[i], transform, instances);
 	}
 }
 
-std::vector<Tri> Model::getModelTris()
+ArrayView<glm::vec3> Model::getVertexPositions()
+{
+	return ArrayView<glm::vec3>(vertexPositions);
+}
+
+ArrayView<VertexAttributes> Model::getVertexAttributes()
+{
+	return ArrayView<VertexAttributes>(vertexAttributes);
+}
+
+ArrayView<GLuint> Model::getIndices()
+{
+	return ArrayView<GLuint>(indices);
+}
+
+int Model::getTriangleCount()
 {
-	return modelTris;
+	return indices.size() / 3;
 }
 
-std::vector<Texture> Model::getTextures()
+const std::vector<Texture>& Model::getTextures()
 {
 	return texturesLoaded;
 }
 
+ArrayView<Material> Model::getMaterials()
+{
+	return ArrayView<Material>(materials);
+}
+
+void Model::moveGeometry(std::vector<glm::vec3> *positions, std::vector<VertexAttributes> *attributes, std::vector<GLuint> *indices)
+{
+	*positions = std::move(vertexPositions);
+	*attributes = std::move(vertexAttributes);
+	*indices = std::move(this->indices);
+	vertexPositions.clear();
+	vertexAttributes.clear();
+	this->indices.clear();
+}
+
 GLint Model::loadTextureFromFile(const char* path)
 {
-	//Generate texture ID and load texture data 
-	std::string filename = std::string(path);
-	filename = directory + '/' + filename;
-	GLuint textureID;
-	glGenTextures(1, &textureID);
-	int width, height;
-	unsigned char* image = SOIL_load_image(filename.c_str(), &width, &height, 0, SOIL_LOAD_RGBA);
-	// Assign texture to ID
-	glBindTexture(GL_TEXTURE_2D, textureID);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image);
-	glBindTexture(GL_TEXTURE_2D, 0);
-	SOIL_free_image_data(image);
-	return textureID;
+	PendingTexture* pending = new PendingTexture();
+	pending->filename = directory + '/' + std::string(path);
+	pending->image = nullptr;
+	pending->width = 0;
+	pending->height = 0;
+	pending->decoded = false;
+	pendingTextures.push_back(pending);
+
+	auto decode = [pending]()
+	{
+		pending->image = SOIL_load_image(pending->filename.c_str(), &pending->width, &pending->height, 0, SOIL_LOAD_RGBA);
+		pending->decoded = true;
+	};
+
+	if (pool != nullptr)
+	{
+		pool->submit(&decodeGroup, decode);
+	}
+	else
+	{
+		decode();
+	}
+
+	return pendingTextures.size() - 1;
+}
+
+bool Model::updateTextures()
+{
+	return this->uploadTextures(0);
+}
+
+void Model::finishTextures()
+{
+	if (pool != nullptr)
+	{
+		pool->wait(&decodeGroup);
+	}
+
+	while (!texturesReady && pendingTextures.size() > 0)
+	{
+		this->uploadTextures(FENCE_WAIT);
+	}
+}
+
+bool Model::uploadTextures(GLuint64 timeout)
+{
+	if (texturesReady || pendingTextures.size() == 0)
+	{
+		return false;
+	}
+
+	//Textures are grouped into arrays by size, so they are allocated once all are decoded
+	if (textureArrays.empty())
+	{
+		for (int i = 0; i < pendingTextures.size(); i++)
+		{
+			if (!pendingTextures[i]->decoded)
+			{
+				return false;
+			}
+		}
+		this->allocateTextureArrays();
+	}
+
+	//A staging buffer is only reused once the copy out of it has finished
+	bool inFlight = false;
+	for (int i = 0; i < NUM_PIXEL_BUFFERS; i++)
+	{
+		if (pixelBuffers[i].fence == nullptr)
+		{
+			continue;
+		}
+
+		GLenum status = glClientWaitSync(pixelBuffers[i].fence, GL_SYNC_FLUSH_COMMANDS_BIT, timeout);
+		if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED)
+		{
+			glDeleteSync(pixelBuffers[i].fence);
+			pixelBuffers[i].fence = nullptr;
+		}
+		else
+		{
+			inFlight = true;
+		}
+	}
+
+	//Each free buffer takes the next texture, its copy runs while later frames render
+	for (int i = 0; i < NUM_PIXEL_BUFFERS && nextUpload < pendingTextures.size(); i++)
+	{
+		if (pixelBuffers[i].fence == nullptr)
+		{
+			this->uploadTexture(nextUpload++, &pixelBuffers[i]);
+			inFlight = true;
+		}
+	}
+
+	if (inFlight || nextUpload < pendingTextures.size())
+	{
+		return false;
+	}
+
+	for (int a = 0; a < textureArrays.size(); a++)
+	{
+		glBindTexture(GL_TEXTURE_2D_ARRAY, textureArrays[a]);
+		glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	}
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+	this->releaseUploadState();
+	texturesReady = true;
+	return true;
+}
+
+void Model::allocateTextureArrays()
+{
+	GLint maxSize = 0;
+	GLint maxLayers = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+	glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+
+	//Every layer of an array has the array's size, so textures are grouped by
+	//their own size rather than all stretched to the largest one
+	int numTextures = pendingTextures.size();
+	std::vector<glm::ivec2> sizes;
+	std::vector<int> groups(numTextures);
+	for (int i = 0; i < numTextures; i++)
+	{
+		PendingTexture* pending = pendingTextures[i];
+		if (pending->image == nullptr)
+		{
+			std::cout << "ERROR::SOIL:: Could not load " << pending->filename << std::endl;
+			pending->width = 1;
+			pending->height = 1;
+		}
+		else if (pending->width > maxSize || pending->height > maxSize)
+		{
+			std::cout << "ERROR::TEXTURE:: Larger than " << maxSize << " texels " << pending->filename << std::endl;
+			SOIL_free_image_data(pending->image);
+			pending->image = nullptr;
+			pending->width = 1;
+			pending->height = 1;
+		}
+
+		glm::ivec2 size = glm::ivec2(pending->width, pending->height);
+		groups[i] = std::find(sizes.begin(), sizes.end(), size) - sizes.begin();
+		if (groups[i] == sizes.size())
+		{
+			sizes.push_back(size);
+		}
+	}
+
+	//With more sizes than samplers the two smallest groups are merged, taking
+	//the larger of each dimension. Texture co-ords are normalised so stretching
+	//a texture over its layer leaves sampling and GL_REPEAT unaffected
+	while (sizes.size() > MAX_TEXTURE_ARRAYS)
+	{
+		auto area = [&sizes](int group) { return (long long)sizes[group].x * sizes[group].y; };
+		int first = 0;
+		int second = 1;
+		for (int group = 1; group < sizes.size(); group++)
+		{
+			if (area(group) < area(first))
+			{
+				second = first;
+				first = group;
+			}
+			else if (area(group) < area(second))
+			{
+				second = group;
+			}
+		}
+
+		int kept = std::min(first, second);
+		int merged = std::max(first, second);
+		sizes[kept] = glm::max(sizes[kept], sizes[merged]);
+		sizes.erase(sizes.begin() + merged);
+		for (int i = 0; i < numTextures; i++)
+		{
+			groups[i] = groups[i] == merged ? kept : groups[i] > merged ? groups[i] - 1 : groups[i];
+		}
+	}
+
+	std::vector<int> layers(sizes.size(), 0);
+	textureSlots.assign(numTextures, glm::ivec2(-1));
+	for (int i = 0; i < numTextures; i++)
+	{
+		if (layers[groups[i]] >= maxLayers)
+		{
+			std::cout << "ERROR::TEXTURE:: More than " << maxLayers << " layers, not loading " << pendingTextures[i]->filename << std::endl;
+			continue;
+		}
+		textureSlots[i] = glm::ivec2(groups[i], layers[groups[i]]++);
+	}
+
+	//RGBA8 is a quarter of the RGBA32F the textures used to be stored as
+	textureArrays.resize(sizes.size());
+	glGenTextures(textureArrays.size(), &textureArrays[0]);
+	for (int a = 0; a < textureArrays.size(); a++)
+	{
+		GLsizei levels = 1 + (GLsizei)std::floor(std::log2((float)std::max(sizes[a].x, sizes[a].y)));
+		glBindTexture(GL_TEXTURE_2D_ARRAY, textureArrays[a]);
+		glTexStorage3D(GL_TEXTURE_2D_ARRAY, levels, GL_RGBA8, sizes[a].x, sizes[a].y, layers[a]);
+	}
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+	arraySizes = sizes;
+	nextUpload = 0;
+
+	//Framebuffers for stretching textures that are not the size of their array
+	glGenFramebuffers(2, stretchFramebuffers);
+}
+
+void Model::uploadTexture(int index, PixelBuffer *staging)
+{
+	PendingTexture* pending = pendingTextures[index];
+	glm::ivec2 slot = textureSlots[index];
+	if (slot.x < 0)
+	{
+		return;
+	}
+	GLuint textureArray = textureArrays[slot.x];
+	glm::ivec2 size = arraySizes[slot.x];
+	const unsigned char* image = pending->image != nullptr ? pending->image : WHITE_TEXEL;
+
+	//The buffer is idle once its fence has signalled, so it is written without
+	//waiting on the GPU and only grows when a texture doesn't fit
+	GLsizeiptr bytes = (GLsizeiptr)pending->width * pending->height * 4;
+	if (staging->buffer == 0)
+	{
+		glGenBuffers(1, &staging->buffer);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging->buffer);
+	if (bytes > staging->capacity)
+	{
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+		staging->capacity = bytes;
+	}
+	void* pixels = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+	memcpy(pixels, image, bytes);
+	glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+	if (pending->width == size.x && pending->height == size.y)
+	{
+		glBindTexture(GL_TEXTURE_2D_ARRAY, textureArray);
+		glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, slot.y, size.x, size.y, 1, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+	}
+	else
+	{
+		GLuint stretchTexture;
+		glGenTextures(1, &stretchTexture);
+		glBindTexture(GL_TEXTURE_2D, stretchTexture);
+		glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, pending->width, pending->height);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, pending->width, pending->height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, stretchFramebuffers[0]);
+		glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, stretchTexture, 0);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, stretchFramebuffers[1]);
+		glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, textureArray, 0, slot.y);
+		glBlitFramebuffer(0, 0, pending->width, pending->height, 0, 0, size.x, size.y, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+		glDeleteTextures(1, &stretchTexture);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	staging->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	//The decoded image isn't needed once it is in the buffer
+	SOIL_free_image_data(pending->image);
+	pending->image = nullptr;
+}
+
+void Model::releaseUploadState()
+{
+	for (int i = 0; i < NUM_PIXEL_BUFFERS; i++)
+	{
+		if (pixelBuffers[i].fence != nullptr)
+		{
+			glDeleteSync(pixelBuffers[i].fence);
+		}
+		if (pixelBuffers[i].buffer != 0)
+		{
+			glDeleteBuffers(1, &pixelBuffers[i].buffer);
+		}
+		pixelBuffers[i] = PixelBuffer();
+	}
+
+	if (stretchFramebuffers[0] != 0)
+	{
+		glDeleteFramebuffers(2, stretchFramebuffers);
+		stretchFramebuffers[0] = 0;
+		stretchFramebuffers[1] = 0;
+	}
+
+	for (int i = 0; i < pendingTextures.size(); i++)
+	{
+		SOIL_free_image_data(pendingTextures[i]->image);
+		delete pendingTextures[i];
+	}
+	pendingTextures.clear();
 }
 
 bool Model::hasTexture()
 {
-	return texturesLoaded.size() > 0;
+	return texturesReady;
+}
+
+const std::vector<GLuint>& Model::getTextureArrays()
+{
+	return textureArrays;
+}
+
+std::vector<Material> Model::getTexturedMaterials(ArrayView<Material> materials)
+{
+	std::vector<Material> result(materials.begin(), materials.end());
+	for (int i = 0; i < result.size(); i++)
+	{
+		int texture = result[i].diffuseTexture;
+		glm::ivec2 slot = texture >= 0 && texture < textureSlots.size() ? textureSlots[texture] : glm::ivec2(-1);
+		result[i].diffuseArray = slot.x;
+		result[i].diffuseLayer = slot.y;
+	}
+	return result;
 }
 
 Model::~Model()
 {
+	//Decode tasks write into the pending textures so they have to finish first
+	if (pool != nullptr)
+	{
+		pool->wait(&decodeGroup);
+	}
+
+	for (int i = 0; i < pendingTextures.size(); i++)
+	{
+		SOIL_free_image_data(pendingTextures[i]->image);
+		delete pendingTextures[i];
+	}
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <iostream>
 #include <vector>
 
@@ -21,47 +22,140 @@
 //SOIL
 #include <SOIL/SOIL.h>
 
-struct Tri {
-	glm::vec4 p0;
-	glm::vec4 p1;
-	glm::vec4 p2;
-	glm::vec4 norm;
-	glm::vec4 tex0;
-	glm::vec4 tex1;
-	glm::vec4 tex2;
+#include "ArrayView.h"
+#include "ThreadPool.h"
+
+//Shading data for a vertex, only fetched for the closest hit. Six tightly
+//packed words, read as vertexAttrib in raycast.csh. A tex of -1 means the
+//mesh has no texture co-ords. Vertices are never shared between meshes, so
+//the material of a triangle's first vertex is the triangle's material.
+struct VertexAttributes {
+	glm::vec3 norm;
+	glm::vec2 tex;
+	GLuint material;
+};
+
+//Laid out to match the std430 Material struct in raycast.csh
+struct Material {
+	//Index of the diffuse texture in the model, -1 for none
+	GLint diffuseTexture;
+	//Texture array and layer holding the diffuse texture, -1 until the textures are uploaded
+	GLint diffuseArray;
+	GLint diffuseLayer;
 };
 
 struct Texture {
+	//Index of the texture in the model
 	GLint id;
 	aiString path;
 	std::string type;
 };
 
-
 class Model
 {
 	public:
-		Model(std::string path);
+		Model();
+		Model(std::string path, ThreadPool *pool = nullptr);
 		~Model();
 
 		std::vector<Texture> Model::loadMaterialTextures(aiMaterial* mat, aiTextureType type, std::string typeName, std::string directory);
-		void loadModel(std::string path);
-		void processMaterial(aiMesh* mesh, const aiScene* scene, std::vector<Texture> *textures);
-		void processMesh(aiMesh* mesh);
-		void processModel(const aiScene* scene, aiNode* node);
-
-		std::vector<Tri> getModelTris();
-		std::vector<Texture> getTextures();
-
+		//Meshes are converted across the pool when one is given
+		void loadModel(std::string path, ThreadPool *pool = nullptr);
+		//Loads textures found by an earlier import of the model at path, keeping their layers
+		void loadTextures(std::string path, std::vector<Texture> textures, ThreadPool *pool = nullptr);
+		Material processMaterial(aiMaterial* material);
+
+		//A mesh placed by a node, with where its vertices and indices go in the model
+		struct MeshInstance {
+			aiMesh* mesh;
+			glm::mat4 transform;
+			GLuint firstVertex;
+			GLuint firstIndex;
+		};
+
+		void processMesh(const MeshInstance &instance);
+		void processModel(const aiScene* scene, aiNode* node, glm::mat4 parentTransform, std::vector<MeshInstance> *instances);
+
+		//Vertices are shared between triangles, every three indices make a triangle.
+		//The views are only valid while the model still owns its geometry
+		ArrayView<glm::vec3> getVertexPositions();
+		ArrayView<VertexAttributes> getVertexAttributes();
+		ArrayView<GLuint> getIndices();
+		int getTriangleCount();
+		const std::vector<Texture>& getTextures();
+		//Indexed by VertexAttributes::material
+		ArrayView<Material> getMaterials();
+
+		//Hands the geometry to the caller without a copy, the model is left empty
+		void moveGeometry(std::vector<glm::vec3> *positions, std::vector<VertexAttributes> *attributes, std::vector<GLuint> *indices);
+
+		//Starts decoding the texture and returns its index, the textures are uploaded by updateTextures
 		GLint loadTextureFromFile(const char* path);
+		//Once every texture has decoded, allocates the texture arrays and copies a few textures
+		//into them each call. True on the call that finishes them. Call once a frame
+		bool updateTextures();
+		//Blocks until every texture is decoded and uploaded
+		void finishTextures();
+
+		//Most arrays the textures are split into, one modelTex sampler each in raycast.csh
+		static const int MAX_TEXTURE_ARRAYS = 8;
 
+		//True once the texture arrays are uploaded and can be sampled
 		bool hasTexture();
+		//GL_TEXTURE_2D_ARRAYs holding the model's textures, one per texture size
+		const std::vector<GLuint>& getTextureArrays();
+		//Copies materials with the array and layer of their diffuse texture filled in
+		std::vector<Material> getTexturedMaterials(ArrayView<Material> materials);
 		
 
 	private:
-		std::vector<Tri> modelTris;
+		//A texture still decoding on the pool or waiting for its upload
+		struct PendingTexture {
+			std::string filename;
+			unsigned char* image;
+			int width;
+			int height;
+			std::atomic<bool> decoded;
+		};
+
+		//A staging buffer for texture uploads, free again once its fence has signalled
+		struct PixelBuffer {
+			GLuint buffer = 0;
+			GLsizeiptr capacity = 0;
+			GLsync fence = nullptr;
+		};
+
+		//Textures copied at once, each through its own buffer
+		static const int NUM_PIXEL_BUFFERS = 4;
+		//Nanoseconds finishTextures waits on a copy before checking the others
+		static const GLuint64 FENCE_WAIT = 1000000;
+
+		void allocateTextureArrays();
+		//Issues the copy of a texture into its layer through staging, fencing the buffer
+		void uploadTexture(int index, PixelBuffer *staging);
+		bool uploadTextures(GLuint64 timeout);
+		void releaseUploadState();
+
+		std::vector<glm::vec3> vertexPositions;
+		std::vector<VertexAttributes> vertexAttributes;
+		std::vector<GLuint> indices;
 		std::string directory;
 		std::vector<Texture> texturesLoaded;
+		std::vector<Material> materials;
+		std::vector<GLuint> textureArrays;
+		//Array and layer of each texture, -1 for one that couldn't be given a layer
+		std::vector<glm::ivec2> textureSlots;
+		std::vector<glm::ivec2> arraySizes;
+		bool texturesReady;
+
+		PixelBuffer pixelBuffers[NUM_PIXEL_BUFFERS];
+		GLuint stretchFramebuffers[2];
+		//Next texture to copy into its layer
+		int nextUpload;
+
+		ThreadPool *pool;
+		TaskGroup decodeGroup;
+		std::vector<PendingTexture*> pendingTextures;
 
 };
 
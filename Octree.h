@@ -0,0 +1,274 @@
+#pragma once
+
+#include <vector>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtx/transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include "Frustum.h"
+
+//Octree over axis aligned boxes. Objects are inserted and then the tree is
+//built in one pass, splitting each node into octants around its centre by the
+//object centroids. Every node keeps the tight bounds of everything below it and
+//a contiguous range of the object array, so a node that is wholly inside the
+//frustum is emitted without testing its objects one at a time.
+template <typename T>
+class Octree
+{
+	public:
+		Octree();
+		~Octree();
+
+		void insert(T obj, glm::vec3 boundsMin, glm::vec3 boundsMax);
+		void build();
+		void clear();
+
+		void search(const Frustum &frustum, std::vector<T> *results);
+
+		int getNodeCount();
+		int getObjectCount();
+
+	protected:
+		struct Item {
+			T obj;
+			glm::vec3 boundsMin;
+			glm::vec3 boundsMax;
+		};
+
+		struct Node {
+			glm::vec3 boundsMin;
+			glm::vec3 boundsMax;
+			int first;
+			int count;
+			int firstChild;
+			int numChildren;
+		};
+
+		void buildNode(int nodeIndex, glm::vec3 centre, glm::vec3 halfSize, int depth);
+		glm::vec3 getItemCentre(const Item &item);
+
+		std::vector<Item> items;
+		std::vector<Item> scratch;
+		std::vector<Node> nodes;
+
+		static const int MAX_LEAF_SIZE = 8;
+		static const int MAX_DEPTH = 16;
+
+};
+
+
+
+template <typename T>
+Octree<T>::Octree()
+{
+}
+
+template <typename T>
+void Octree<T>::insert(T obj, glm::vec3 boundsMin, glm::vec3 boundsMax)
+{
+	items.push_back({ obj, boundsMin, boundsMax });
+}
+
+template <typename T>
+void Octree<T>::build()
+{
+	nodes.clear();
+	if (items.size() == 0)
+	{
+		return;
+	}
+
+	glm::vec3 sceneMin = items[0].boundsMin;
+	glm::vec3 sceneMax = items[0].boundsMax;
+	for (int i = 1; i < items.size(); i++)
+	{
+		sceneMin = glm::min(sceneMin, items[i].boundsMin);
+		sceneMax = glm::max(sceneMax, items[i].boundsMax);
+	}
+
+	//Use a cube so that octants stay cubes as well
+	glm::vec3 extent = sceneMax - sceneMin;
+	float halfSize = glm::max(glm::max(extent.x, extent.y), extent.z) * 0.5f;
+
+	Node root;
+	root.first = 0;
+	root.count = items.size();
+	nodes.push_back(root);
+
+	scratch.resize(items.size());
+	buildNode(0, (sceneMin + sceneMax) * 0.5f, glm::vec3(halfSize), 0);
+	scratch.clear();
+}
+
+template <typename T>
+void Octree<T>::buildNode(int nodeIndex, glm::vec3 centre, glm::vec3 halfSize, int depth)
+{
+	int first = nodes[nodeIndex].first;
+	int count = nodes[nodeIndex].count;
+
+	glm::vec3 boundsMin = items[first].boundsMin;
+	glm::vec3 boundsMax = items[first].boundsMax;
+	for (int i = first + 1; i < first + count; i++)
+	{
+		boundsMin = glm::min(boundsMin, items[i].boundsMin);
+		boundsMax = glm::max(boundsMax, items[i].boundsMax);
+	}
+	nodes[nodeIndex].boundsMin = boundsMin;
+	nodes[nodeIndex].boundsMax = boundsMax;
+	nodes[nodeIndex].firstChild = -1;
+	nodes[nodeIndex].numChildren = 0;
+
+	if (count <= MAX_LEAF_SIZE || depth == MAX_DEPTH)
+	{
+		return;
+	}
+
+	//Counting sort of the node's items by octant
+	int octantCount[8] = { 0 };
+	for (int i = first; i < first + count; i++)
+	{
+		glm::vec3 c = getItemCentre(items[i]);
+		int octant = (c.x >= centre.x ? 1 : 0) | (c.y >= centre.y ? 2 : 0) | (c.z >= centre.z ? 4 : 0);
+		octantCount[octant]++;
+	}
+
+	int octantStart[8];
+	int offset = first;
+	int numChildren = 0;
+	for (int o = 0; o < 8; o++)
+	{
+		octantStart[o] = offset;
+		offset += octantCount[o];
+		if (octantCount[o] > 0)
+		{
+			numChildren++;
+		}
+	}
+
+	int fill[8];
+	for (int o = 0; o < 8; o++)
+	{
+		fill[o] = octantStart[o];
+	}
+	for (int i = first; i < first + count; i++)
+	{
+		glm::vec3 c = getItemCentre(items[i]);
+		int octant = (c.x >= centre.x ? 1 : 0) | (c.y >= centre.y ? 2 : 0) | (c.z >= centre.z ? 4 : 0);
+		scratch[fill[octant]++] = items[i];
+	}
+	for (int i = first; i < first + count; i++)
+	{
+		items[i] = scratch[i];
+	}
+
+	//Children are stored next to each other so the parent only needs the first index
+	int firstChild = nodes.size();
+	nodes[nodeIndex].firstChild = firstChild;
+	nodes[nodeIndex].numChildren = numChildren;
+	for (int o = 0; o < 8; o++)
+	{
+		if (octantCount[o] > 0)
+		{
+			Node child;
+			child.first = octantStart[o];
+			child.count = octantCount[o];
+			nodes.push_back(child);
+		}
+	}
+
+	glm::vec3 childHalfSize = halfSize * 0.5f;
+	int child = firstChild;
+	for (int o = 0; o < 8; o++)
+	{
+		if (octantCount[o] == 0)
+		{
+			continue;
+		}
+
+		glm::vec3 childCentre = centre + glm::vec3(
+			(o & 1) ? childHalfSize.x : -childHalfSize.x,
+			(o & 2) ? childHalfSize.y : -childHalfSize.y,
+			(o & 4) ? childHalfSize.z : -childHalfSize.z);
+		buildNode(child++, childCentre, childHalfSize, depth + 1);
+	}
+}
+
+template <typename T>
+glm::vec3 Octree<T>::getItemCentre(const Item &item)
+{
+	return (item.boundsMin + item.boundsMax) * 0.5f;
+}
+
+template <typename T>
+void Octree<T>::clear()
+{
+	items.clear();
+	nodes.clear();
+}
+
+template <typename T>
+void Octree<T>::search(const Frustum &frustum, std::vector<T> *results)
+{
+	if (nodes.size() == 0)
+	{
+		return;
+	}
+
+	int stack[8 * MAX_DEPTH + 1];
+	int stackPtr = 0;
+	stack[stackPtr++] = 0;
+
+	while (stackPtr > 0)
+	{
+		Node &node = nodes[stack[--stackPtr]];
+
+		Frustum::Classification c = frustum.classify(node.boundsMin, node.boundsMax);
+		if (c == Frustum::OUTSIDE)
+		{
+			continue;
+		}
+
+		if (c == Frustum::INSIDE)
+		{
+			for (int i = node.first; i < node.first + node.count; i++)
+			{
+				results->push_back(items[i].obj);
+			}
+		}
+		else if (node.numChildren == 0)
+		{
+			for (int i = node.first; i < node.first + node.count; i++)
+			{
+				if (frustum.intersects(items[i].boundsMin, items[i].boundsMax))
+				{
+					results->push_back(items[i].obj);
+				}
+			}
+		}
+		else
+		{
+			for (int i = 0; i < node.numChildren; i++)
+			{
+				stack[stackPtr++] = node.firstChild + i;
+			}
+		}
+	}
+}
+
+template <typename T>
+int Octree<T>::getNodeCount()
+{
+	return nodes.size();
+}
+
+template <typename T>
+int Octree<T>::getObjectCount()
+{
+	return items.size();
+}
+
+template <typename T>
+Octree<T>::~Octree()
+{
+}
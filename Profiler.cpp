@@ -0,0 +1,173 @@
+#include "Profiler.h"
+
+#include <algorithm>
+
+
+StageStats::StageStats(std::string name)
+{
+	this->name = name;
+}
+
+void StageStats::add(float ms)
+{
+	samples.push_back(ms);
+}
+
+void StageStats::reset()
+{
+	samples.clear();
+}
+
+int StageStats::getCount()
+{
+	return samples.size();
+}
+
+float StageStats::getMin()
+{
+	if (samples.size() == 0)
+	{
+		return 0;
+	}
+	return *std::min_element(samples.begin(), samples.end());
+}
+
+float StageStats::getAverage()
+{
+	if (samples.size() == 0)
+	{
+		return 0;
+	}
+
+	float total = 0;
+	for (int i = 0; i < samples.size(); i++)
+	{
+		total += samples[i];
+	}
+	return total / samples.size();
+}
+
+float StageStats::getPercentile(float p)
+{
+	if (samples.size() == 0)
+	{
+		return 0;
+	}
+
+	std::vector<float> sorted = samples;
+	int index = std::min((int)(p * sorted.size()), (int)sorted.size() - 1);
+	std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+	return sorted[index];
+}
+
+std::string StageStats::getName()
+{
+	return name;
+}
+
+StageStats::~StageStats()
+{
+}
+
+GpuTimer::GpuTimer(StageStats *stats)
+{
+	this->stats = stats;
+	current = 0;
+	active = false;
+	hasLatest = false;
+	latestMs = 0;
+	latestTag = 0;
+	glGenQueries(NUM_QUERIES, queries);
+	for (int i = 0; i < NUM_QUERIES; i++)
+	{
+		pending[i] = false;
+		tags[i] = 0;
+	}
+}
+
+void GpuTimer::collect()
+{
+	//Queries were issued in ring order starting after current, and finish in that order
+	for (int k = 0; k < NUM_QUERIES; k++)
+	{
+		int i = (current + k) % NUM_QUERIES;
+		if (!pending[i])
+		{
+			continue;
+		}
+
+		GLint available = 0;
+		glGetQueryObjectiv(queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available)
+		{
+			break;
+		}
+
+		GLuint64 elapsed = 0;
+		glGetQueryObjectui64v(queries[i], GL_QUERY_RESULT, &elapsed);
+		stats->add(elapsed / 1000000.0f);
+		hasLatest = true;
+		latestMs = elapsed / 1000000.0f;
+		latestTag = tags[i];
+		pending[i] = false;
+	}
+}
+
+void GpuTimer::begin(int tag)
+{
+	collect();
+
+	//Every query is still in flight, skip this frame rather than lose a result
+	active = !pending[current];
+	if (!active)
+	{
+		return;
+	}
+
+	tags[current] = tag;
+	glBeginQuery(GL_TIME_ELAPSED, queries[current]);
+}
+
+void GpuTimer::end()
+{
+	if (!active)
+	{
+		return;
+	}
+
+	glEndQuery(GL_TIME_ELAPSED);
+	pending[current] = true;
+	current = (current + 1) % NUM_QUERIES;
+	active = false;
+}
+
+bool GpuTimer::getLatest(float *ms, int *tag)
+{
+	collect();
+	if (!hasLatest)
+	{
+		return false;
+	}
+
+	*ms = latestMs;
+	*tag = latestTag;
+	hasLatest = false;
+	return true;
+}
+
+GpuTimer::~GpuTimer()
+{
+	glDeleteQueries(NUM_QUERIES, queries);
+}
+
+ScopedTimer::ScopedTimer(StageStats *stats)
+{
+	this->stats = stats;
+	start = std::chrono::high_resolution_clock::now();
+}
+
+ScopedTimer::~ScopedTimer()
+{
+	auto end = std::chrono::high_resolution_clock::now();
+	stats->add(std::chrono::duration<float, std::milli>(end - start).count());
+}
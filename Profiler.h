@@ -0,0 +1,83 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+// GLEW
+#define GLEW_STATIC
+#include <GL/glew.h>
+
+//Collects timing samples for one stage of the frame, in milliseconds
+class StageStats
+{
+	public:
+		StageStats(std::string name);
+		~StageStats();
+
+		void add(float ms);
+		void reset();
+
+		int getCount();
+		float getMin();
+		float getAverage();
+		//p in [0, 1], e.g. 0.99 for the 99th percentile
+		float getPercentile(float p);
+		std::string getName();
+
+	protected:
+		std::string name;
+		std::vector<float> samples;
+
+};
+
+//Measures the GPU time of the commands between begin and end with
+//GL_TIME_ELAPSED queries. A ring of queries is used in turn and results are
+//read back in order once the GPU reports them available, so timing never
+//stalls the pipeline. A query still waiting for its result is never reused;
+//if every query is waiting the frame is simply not timed.
+class GpuTimer
+{
+	public:
+		GpuTimer(StageStats *stats);
+		~GpuTimer();
+
+		//tag is handed back with the result so it can be matched to the work measured
+		void begin(int tag = 0);
+		void end();
+		//The newest result not yet returned, false if none has arrived since the last call
+		bool getLatest(float *ms, int *tag);
+
+	protected:
+		//Enough for several frames of GPU latency
+		static const int NUM_QUERIES = 8;
+
+		//Reads back every finished query, oldest first
+		void collect();
+
+		StageStats *stats;
+		GLuint queries[NUM_QUERIES];
+		bool pending[NUM_QUERIES];
+		int tags[NUM_QUERIES];
+		int current;
+		//Whether begin started a query for end to close
+		bool active;
+
+		bool hasLatest;
+		float latestMs;
+		int latestTag;
+
+};
+
+//Adds the wall clock time between its construction and destruction to a stage
+class ScopedTimer
+{
+	public:
+		ScopedTimer(StageStats *stats);
+		~ScopedTimer();
+
+	protected:
+		StageStats *stats;
+		std::chrono::high_resolution_clock::time_point start;
+
+};
@@ -6,6 +6,15 @@
 #include <glm/gtx/transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define QUADTREE_SSE
+#endif
+
+//Point quadtree whose nodes all live in one arena. Children are referenced by
+//index (the four children of a node are stored next to each other) and leaves
+//keep their points and objects in fixed size buckets of two shared flat arrays,
+//so the whole tree is freed or rebuilt by clearing those arrays.
 template <typename T>
 class Quadtree
 {
@@ -13,50 +22,145 @@ class Quadtree
 		Quadtree(glm::vec2 centre, glm::vec2 size);
 		~Quadtree();
 
+		//Empties the tree and gives it new bounds, keeping the arena's memory
+		void reset(glm::vec2 centre, glm::vec2 size);
+
 		bool insert(T obj, glm::vec2 p);
 		bool inBoundry(glm::vec2 p);
 		bool inBoundry(glm::vec2 p, glm::vec2 c, glm::vec2 s);
 		bool boundryIntersect(glm::vec2 c1, glm::vec2 s1, glm::vec2 c2, glm::vec2 s2);
+		//Tests all four children of a node against the rectangle at once, bit i of
+		//the result is set if the child at firstChild + i overlaps it
+		int boundryIntersectChildren(int node, glm::vec2 c, glm::vec2 s);
 		bool search(glm::vec2 p);
-		
-		std::vector<T> search(glm::vec2 c, glm::vec2 s);
 
+		std::vector<T> search(glm::vec2 c, glm::vec2 s);
+		//Appends the matches to a caller owned buffer, reusing its capacity
+		void search(glm::vec2 c, glm::vec2 s, std::vector<T> *results);
+		//Appends the arena slots of the matches, see getObject
+		void searchSlots(glm::vec2 c, glm::vec2 s, std::vector<int> *results);
+		//Calls visit(obj, slot) for every match without allocating
+		template <typename Visitor>
+		void query(glm::vec2 c, glm::vec2 s, Visitor visit);
+
+		const T& getObject(int slot);
 		glm::vec2 getCentre();
 		glm::vec2 getSize();
 
-		void subdivide();
+		int getNodeCount();
+		size_t getMemoryUsage();
 
 	protected:
+		static const int NODE_CAPACITY = 4;
+
+		//Children are stored as north west, north east, south west, south east
+		enum { NORTH_WEST, NORTH_EAST, SOUTH_WEST, SOUTH_EAST };
+
+		struct Node {
+			glm::vec2 centre;
+			glm::vec2 size;
+			int firstChild;
+			int bucket;
+			int count;
+		};
+
+		//Bounds of a node's four children packed so they load as one vector per component
+		struct ChildBounds {
+			float minX[4];
+			float minY[4];
+			float maxX[4];
+			float maxY[4];
+		};
+
+		int createNode(glm::vec2 centre, glm::vec2 size);
+		int allocateBucket();
+		int findChild(int node, glm::vec2 p);
+		int childGroup(int node);
+		void subdivide(int node);
+
+		std::vector<Node> nodes;
+		//Indexed by childGroup, one entry for every node that has been subdivided
+		std::vector<ChildBounds> childBounds;
+		//Traversal stack kept between queries so searching never allocates once warm
+		std::vector<int> stack;
+
+		//Leaf buckets, bucket b owns slots [b * NODE_CAPACITY, (b + 1) * NODE_CAPACITY)
+		std::vector<T> objects;
+		std::vector<glm::vec2> points;
+		std::vector<int> freeBuckets;
 
+};
 
-		bool leaf;
-
-		glm::vec2 centre;
-		glm::vec2 size;
 
-		std::vector<T> objects;
-		std::vector<glm::vec2> points;
 
-		Quadtree *northWest;
-		Quadtree *northEast;
-		Quadtree *southWest;
-		Quadtree *southEast;
+template <typename T>
+Quadtree<T>::Quadtree(glm::vec2 c, glm::vec2 s)
+{
+	reset(c, s);
+}
 
+template <typename T>
+void Quadtree<T>::reset(glm::vec2 c, glm::vec2 s)
+{
+	nodes.clear();
+	childBounds.clear();
+	objects.clear();
+	points.clear();
+	freeBuckets.clear();
 
+	createNode(c, s);
+}
 
+template <typename T>
+int Quadtree<T>::createNode(glm::vec2 c, glm::vec2 s)
+{
+	Node node;
+	node.centre = c;
+	node.size = s;
+	node.firstChild = -1;
+	node.bucket = -1;
+	node.count = 0;
+	nodes.push_back(node);
+
+	return nodes.size() - 1;
+}
 
-	private:
+template <typename T>
+int Quadtree<T>::allocateBucket()
+{
+	if (freeBuckets.size() > 0)
+	{
+		int bucket = freeBuckets.back();
+		freeBuckets.pop_back();
+		return bucket;
+	}
 
-};
+	int bucket = objects.size() / NODE_CAPACITY;
+	objects.resize(objects.size() + NODE_CAPACITY);
+	points.resize(points.size() + NODE_CAPACITY);
+	return bucket;
+}
 
+template <typename T>
+int Quadtree<T>::findChild(int node, glm::vec2 p)
+{
+	int firstChild = nodes[node].firstChild;
+	for (int i = NORTH_WEST; i <= SOUTH_EAST; i++)
+	{
+		if (inBoundry(p, nodes[firstChild + i].centre, nodes[firstChild + i].size))
+		{
+			return firstChild + i;
+		}
+	}
 
+	return -1;
+}
 
 template <typename T>
-Quadtree<T>::Quadtree(glm::vec2 c, glm::vec2 s)
+int Quadtree<T>::childGroup(int node)
 {
-	centre = c;
-	size = s;
-	leaf = true;
+	//Every node after the root is created in a group of four by subdivide
+	return (nodes[node].firstChild - 1) / 4;
 }
 
 template <typename T>
@@ -67,44 +171,41 @@ bool Quadtree<T>::insert(T obj, glm::vec2 p)
 		return false;
 	}
 
-	if (!leaf)
+	int node = 0;
+	while (true)
 	{
-		if (northWest->inBoundry(p))
-		{
-			return northWest->insert(obj, p);
-		}
-		else if (northEast->inBoundry(p))
-		{
-			return northEast->insert(obj, p);
-		}
-		else if (southWest->inBoundry(p))
+		if (nodes[node].firstChild != -1)
 		{
-			return southWest->insert(obj, p);
+			node = findChild(node, p);
+			if (node == -1)
+			{
+				return false;
+			}
+			continue;
 		}
-		else if (southEast->inBoundry(p))
+
+		if (nodes[node].count < NODE_CAPACITY)
 		{
-			return southEast->insert(obj, p);
-		}
+			if (nodes[node].bucket == -1)
+			{
+				nodes[node].bucket = allocateBucket();
+			}
 
-		return false;
-	}
+			int slot = nodes[node].bucket * NODE_CAPACITY + nodes[node].count;
+			objects[slot] = obj;
+			points[slot] = p;
+			nodes[node].count++;
+			return true;
+		}
 
-	if (points.size() < 4)
-	{
-		points.push_back(p);
-		objects.push_back(obj);
-		return true;
+		subdivide(node);
 	}
-
-	subdivide();
-
-	return insert(obj, p);
 }
 
 template <typename T>
 bool Quadtree<T>::inBoundry(glm::vec2 p)
 {
-	return inBoundry(p, centre, size);
+	return inBoundry(p, nodes[0].centre, nodes[0].size);
 }
 
 template <typename T>
@@ -128,62 +229,66 @@ bool Quadtree<T>::inBoundry(glm::vec2 p, glm::vec2 c, glm::vec2 s)
 template <typename T>
 bool Quadtree<T>::boundryIntersect(glm::vec2 c1, glm::vec2 s1, glm::vec2 c2, glm::vec2 s2)
 {
-	glm::vec2 topLeftCorner = glm::vec2(c1.x - 0.5*s1.x, c1.y + 0.5*s1.y);
-	glm::vec2 topRightCorner = glm::vec2(c1.x + 0.5*s1.x, c1.y + 0.5*s1.y);
-	glm::vec2 botLeftCorner = glm::vec2(c1.x - 0.5*s1.x, c1.y - 0.5*s1.y);
-	glm::vec2 botRightCorner = glm::vec2(c1.x + 0.5*s1.x, c1.y - 0.5*s1.y);
+	//Two rectangles overlap when their intervals overlap on both axes. Edges
+	//count as overlapping, the same as inBoundry.
+	glm::vec2 min1 = c1 - s1 * 0.5f;
+	glm::vec2 max1 = c1 + s1 * 0.5f;
+	glm::vec2 min2 = c2 - s2 * 0.5f;
+	glm::vec2 max2 = c2 + s2 * 0.5f;
+
+	return min1.x <= max2.x && max1.x >= min2.x &&
+		min1.y <= max2.y && max1.y >= min2.y;
+}
 
-	if (inBoundry(topLeftCorner, c2, s2))
-	{
-		return true;
-	}
-	else if (inBoundry(topRightCorner, c2, s2))
-	{
-		return true;
-	}
-	else if (inBoundry(botLeftCorner, c2, s2))
-	{
-		return true;
-	}
-	else if (inBoundry(botRightCorner, c2, s2))
+template <typename T>
+int Quadtree<T>::boundryIntersectChildren(int node, glm::vec2 c, glm::vec2 s)
+{
+	ChildBounds &bounds = childBounds[childGroup(node)];
+	glm::vec2 queryMin = c - s * 0.5f;
+	glm::vec2 queryMax = c + s * 0.5f;
+
+#ifdef QUADTREE_SSE
+	__m128 overlapX = _mm_and_ps(
+		_mm_cmple_ps(_mm_loadu_ps(bounds.minX), _mm_set1_ps(queryMax.x)),
+		_mm_cmpge_ps(_mm_loadu_ps(bounds.maxX), _mm_set1_ps(queryMin.x)));
+	__m128 overlapY = _mm_and_ps(
+		_mm_cmple_ps(_mm_loadu_ps(bounds.minY), _mm_set1_ps(queryMax.y)),
+		_mm_cmpge_ps(_mm_loadu_ps(bounds.maxY), _mm_set1_ps(queryMin.y)));
+	return _mm_movemask_ps(_mm_and_ps(overlapX, overlapY));
+#else
+	int mask = 0;
+	for (int i = NORTH_WEST; i <= SOUTH_EAST; i++)
 	{
-		return true;
+		if (bounds.minX[i] <= queryMax.x && bounds.maxX[i] >= queryMin.x &&
+			bounds.minY[i] <= queryMax.y && bounds.maxY[i] >= queryMin.y)
+		{
+			mask |= 1 << i;
+		}
 	}
-
-	return false;
+	return mask;
+#endif
 }
 
 template <typename T>
 bool Quadtree<T>::search(glm::vec2 p)
 {
-	if (leaf)
+	int node = 0;
+	while (nodes[node].firstChild != -1)
 	{
-		for (int i = 0; i < points.size(); i++)
+		node = findChild(node, p);
+		if (node == -1)
 		{
-			if (p == points[i])
-			{
-				return true;
-			}
+			return false;
 		}
-
-		return false;
 	}
 
-	if (northWest->inBoundry(p))
-	{
-		return northWest->search(p);
-	}
-	else if (northEast->inBoundry(p))
+	int first = nodes[node].bucket * NODE_CAPACITY;
+	for (int i = first; i < first + nodes[node].count; i++)
 	{
-		return northEast->search(p);
-	}
-	else if (southWest->inBoundry(p))
-	{
-		return southWest->search(p);
-	}
-	else if (southEast->inBoundry(p))
-	{
-		return southEast->search(p);
+		if (p == points[i])
+		{
+			return true;
+		}
 	}
 
 	return false;
@@ -193,101 +298,144 @@ template <typename T>
 std::vector<T> Quadtree<T>::search(glm::vec2 c, glm::vec2 s)
 {
 	std::vector<T> results;
-	if (leaf)
-	{
-		for (int i = 0; i < points.size(); i++)
-		{
-			if (inBoundry(points[i], c, s))
-			{
-				results.push_back(objects[i]);
-			}
-		}
-	}
-	else
-	{
-		std::vector<T> childResult;
+	search(c, s, &results);
+	return results;
+}
 
-		if (boundryIntersect(northWest->getCentre(), northWest->getSize(), c, s))
-		{
-			childResult = northWest->search(c, s);
-			for (int i = 0; i < childResult.size(); i++)
-			{
-				results.push_back(childResult[i]);
-			}
-		}
+template <typename T>
+void Quadtree<T>::search(glm::vec2 c, glm::vec2 s, std::vector<T> *results)
+{
+	query(c, s, [results](const T &obj, int) { results->push_back(obj); });
+}
 
-		if (boundryIntersect(northEast->getCentre(), northEast->getSize(), c, s))
-		{
-			childResult = northEast->search(c, s);
-			for (int i = 0; i < childResult.size(); i++)
-			{
-				results.push_back(childResult[i]);
-			}
-		}
+template <typename T>
+void Quadtree<T>::searchSlots(glm::vec2 c, glm::vec2 s, std::vector<int> *results)
+{
+	query(c, s, [results](const T &, int slot) { results->push_back(slot); });
+}
+
+template <typename T>
+template <typename Visitor>
+void Quadtree<T>::query(glm::vec2 c, glm::vec2 s, Visitor visit)
+{
+	stack.clear();
+	stack.push_back(0);
+
+	while (stack.size() > 0)
+	{
+		int node = stack.back();
+		stack.pop_back();
 
-		if (boundryIntersect(southWest->getCentre(), southWest->getSize(), c, s))
+		if (nodes[node].firstChild == -1)
 		{
-			childResult = southWest->search(c, s);
-			for (int i = 0; i < childResult.size(); i++)
+			int first = nodes[node].bucket * NODE_CAPACITY;
+			for (int i = first; i < first + nodes[node].count; i++)
 			{
-				results.push_back(childResult[i]);
+				if (inBoundry(points[i], c, s))
+				{
+					visit(objects[i], i);
+				}
 			}
+			continue;
 		}
 
-		if (boundryIntersect(southEast->getCentre(), southEast->getSize(), c, s))
+		//Pushed in reverse so children are visited in the same order as before
+		int mask = boundryIntersectChildren(node, c, s);
+		for (int i = SOUTH_EAST; i >= NORTH_WEST; i--)
 		{
-			childResult = southEast->search(c, s);
-			for (int i = 0; i < childResult.size(); i++)
+			if (mask & (1 << i))
 			{
-				results.push_back(childResult[i]);
+				stack.push_back(nodes[node].firstChild + i);
 			}
 		}
 	}
+}
 
-	return results;
+template <typename T>
+const T& Quadtree<T>::getObject(int slot)
+{
+	return objects[slot];
 }
 
 template <typename T>
 glm::vec2 Quadtree<T>::getCentre()
 {
-	return centre;
+	return nodes[0].centre;
 }
 
 template <typename T>
 glm::vec2 Quadtree<T>::getSize()
 {
-	return size;
+	return nodes[0].size;
 }
 
 template <typename T>
-void Quadtree<T>::subdivide()
+int Quadtree<T>::getNodeCount()
 {
-	leaf = false;
+	return nodes.size();
+}
 
-	glm::vec2 newCentre = glm::vec2(centre.x - 0.25 * size.x, centre.y - 0.25 * size.y);
-	glm::vec2 newSize = glm::vec2(size.x / 2, size.y / 2);
-	northWest = new Quadtree(newCentre, newSize);
+template <typename T>
+size_t Quadtree<T>::getMemoryUsage()
+{
+	return nodes.capacity() * sizeof(Node) + childBounds.capacity() * sizeof(ChildBounds) + objects.capacity() * sizeof(T) +
+		points.capacity() * sizeof(glm::vec2) + (freeBuckets.capacity() + stack.capacity()) * sizeof(int);
+}
+
+template <typename T>
+void Quadtree<T>::subdivide(int node)
+{
+	glm::vec2 centre = nodes[node].centre;
+	glm::vec2 size = nodes[node].size;
 
-	newCentre = glm::vec2(centre.x + 0.25 * size.x, centre.y - 0.25 * size.y);
-	northEast = new Quadtree(newCentre, newSize);
+	glm::vec2 newSize = glm::vec2(size.x / 2, size.y / 2);
+	int firstChild = createNode(glm::vec2(centre.x - 0.25 * size.x, centre.y - 0.25 * size.y), newSize);
+	createNode(glm::vec2(centre.x + 0.25 * size.x, centre.y - 0.25 * size.y), newSize);
+	createNode(glm::vec2(centre.x - 0.25 * size.x, centre.y + 0.25 * size.y), newSize);
+	createNode(glm::vec2(centre.x + 0.25 * size.x, centre.y + 0.25 * size.y), newSize);
 
-	newCentre = glm::vec2(centre.x - 0.25 * size.x, centre.y + 0.25 * size.y);
-	southWest = new Quadtree(newCentre, newSize);
+	ChildBounds bounds;
+	for (int i = NORTH_WEST; i <= SOUTH_EAST; i++)
+	{
+		glm::vec2 childMin = nodes[firstChild + i].centre - nodes[firstChild + i].size * 0.5f;
+		glm::vec2 childMax = nodes[firstChild + i].centre + nodes[firstChild + i].size * 0.5f;
+		bounds.minX[i] = childMin.x;
+		bounds.minY[i] = childMin.y;
+		bounds.maxX[i] = childMax.x;
+		bounds.maxY[i] = childMax.y;
+	}
+	childBounds.push_back(bounds);
 
-	newCentre = glm::vec2(centre.x + 0.25 * size.x, centre.y + 0.25 * size.y);
-	southEast = new Quadtree(newCentre, newSize);
+	//Hand the node's points down to its children and return its bucket
+	int bucket = nodes[node].bucket;
+	int count = nodes[node].count;
+	nodes[node].firstChild = firstChild;
+	nodes[node].bucket = -1;
+	nodes[node].count = 0;
 
-	for (int i = 0; i < points.size(); i++)
+	for (int i = bucket * NODE_CAPACITY; i < bucket * NODE_CAPACITY + count; i++)
 	{
-		insert(objects[i], points[i]);
+		int child = findChild(node, points[i]);
+		if (child == -1)
+		{
+			continue;
+		}
+
+		if (nodes[child].bucket == -1)
+		{
+			nodes[child].bucket = allocateBucket();
+		}
+
+		int slot = nodes[child].bucket * NODE_CAPACITY + nodes[child].count;
+		objects[slot] = objects[i];
+		points[slot] = points[i];
+		nodes[child].count++;
 	}
 
-	points.clear();
-	objects.clear();
+	freeBuckets.push_back(bucket);
 }
 
 template <typename T>
 Quadtree<T>::~Quadtree()
 {
 }
-
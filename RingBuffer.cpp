@@ -0,0 +1,172 @@
+#include "RingBuffer.h"
+
+#include <cstring>
+
+
+RingBuffer::RingBuffer(GLenum target, GLsizeiptr regionSize, int numRegions)
+{
+	this->target = target;
+	this->numRegions = numRegions;
+	currentRegion = 0;
+	boundRegion = -1;
+	persistent = GLEW_ARB_buffer_storage != 0;
+	buffer = 0;
+	mappedData = nullptr;
+	stagingData = nullptr;
+	stagingSize = 0;
+
+	fences = new GLsync[numRegions];
+	for (int i = 0; i < numRegions; i++)
+	{
+		fences[i] = 0;
+	}
+
+	create(regionSize);
+}
+
+void RingBuffer::create(GLsizeiptr size)
+{
+	//Every region has to start on a boundary glBindBufferRange will accept
+	GLint alignment = 256;
+	if (target == GL_SHADER_STORAGE_BUFFER)
+	{
+		glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	}
+	else if (target == GL_UNIFORM_BUFFER)
+	{
+		glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	}
+	if (size < alignment)
+	{
+		size = alignment;
+	}
+	regionSize = ((size + alignment - 1) / alignment) * alignment;
+
+	glGenBuffers(1, &buffer);
+	glBindBuffer(target, buffer);
+	if (persistent)
+	{
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(target, regionSize * numRegions, nullptr, flags);
+		mappedData = (char*)glMapBufferRange(target, 0, regionSize * numRegions, flags);
+	}
+	else
+	{
+		glBufferData(target, regionSize, nullptr, GL_STREAM_DRAW);
+		stagingData = new char[regionSize];
+		stagingSize = 0;
+	}
+	glBindBuffer(target, 0);
+}
+
+void RingBuffer::destroy()
+{
+	for (int i = 0; i < numRegions; i++)
+	{
+		waitForRegion(i);
+	}
+
+	glBindBuffer(target, buffer);
+	if (persistent)
+	{
+		glUnmapBuffer(target);
+	}
+	glBindBuffer(target, 0);
+	glDeleteBuffers(1, &buffer);
+
+	delete[] stagingData;
+	stagingData = nullptr;
+	mappedData = nullptr;
+	buffer = 0;
+}
+
+void RingBuffer::waitForRegion(int region)
+{
+	if (fences[region] == 0)
+	{
+		return;
+	}
+
+	GLenum result = glClientWaitSync(fences[region], 0, 0);
+	while (result != GL_ALREADY_SIGNALED && result != GL_CONDITION_SATISFIED && result != GL_WAIT_FAILED)
+	{
+		result = glClientWaitSync(fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+	}
+
+	glDeleteSync(fences[region]);
+	fences[region] = 0;
+}
+
+void* RingBuffer::beginWrite(GLsizeiptr size)
+{
+	if (size > regionSize)
+	{
+		//Grow with some headroom so a slowly growing set doesn't reallocate every frame
+		destroy();
+		create(size + size / 2);
+		currentRegion = 0;
+		boundRegion = -1;
+	}
+
+	if (!persistent)
+	{
+		stagingSize = size;
+		return stagingData;
+	}
+
+	waitForRegion(currentRegion);
+	return mappedData + regionSize * currentRegion;
+}
+
+void RingBuffer::bindRange(GLuint index)
+{
+	if (persistent)
+	{
+		glBindBufferRange(target, index, buffer, regionSize * currentRegion, regionSize);
+		boundRegion = currentRegion;
+	}
+	else
+	{
+		//Orphan the old storage so the driver doesn't stall on a buffer still in use
+		glBindBuffer(target, buffer);
+		glBufferData(target, regionSize, nullptr, GL_STREAM_DRAW);
+		glBufferSubData(target, 0, stagingSize, stagingData);
+		glBindBuffer(target, 0);
+		glBindBufferRange(target, index, buffer, 0, regionSize);
+	}
+}
+
+void RingBuffer::endFrame()
+{
+	if (persistent)
+	{
+		fences[currentRegion] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		currentRegion = (currentRegion + 1) % numRegions;
+	}
+}
+
+void RingBuffer::fenceCurrent()
+{
+	if (!persistent || boundRegion < 0)
+	{
+		return;
+	}
+
+	//Commands complete in order, so the new fence also covers whatever the old one did
+	if (fences[boundRegion] != 0)
+	{
+		glDeleteSync(fences[boundRegion]);
+	}
+	fences[boundRegion] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+GLuint RingBuffer::getBuffer()
+{
+	return buffer;
+}
+
+RingBuffer::~RingBuffer()
+{
+	destroy();
+	delete[] fences;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+// GLEW
+#define GLEW_STATIC
+#include <GL/glew.h>
+
+//Streams small per-frame data (such as visible object indices) to the GPU
+//through one persistently mapped buffer split into several regions. Each frame
+//writes into the next region and fences it once the commands reading it are
+//submitted. Frames that read a region again without writing a new one fence it
+//again, so the fence always covers its last reader and the CPU only ever waits
+//if it gets a whole ring ahead of the GPU.
+//Drivers without ARB_buffer_storage fall back to orphaning with glBufferData.
+class RingBuffer
+{
+	public:
+		RingBuffer(GLenum target, GLsizeiptr regionSize, int numRegions = 3);
+		~RingBuffer();
+
+		//Returns a pointer the caller can write size bytes to for this frame
+		void* beginWrite(GLsizeiptr size);
+		//Binds the region written this frame to the given indexed binding point
+		void bindRange(GLuint index);
+		//Fences the region written this frame and moves on to the next one
+		void endFrame();
+		//Replaces the fence of the region last bound, for a frame that read it again without writing
+		void fenceCurrent();
+
+		GLuint getBuffer();
+
+	protected:
+		void create(GLsizeiptr regionSize);
+		void destroy();
+		void waitForRegion(int region);
+
+		GLenum target;
+		GLuint buffer;
+		GLsizeiptr regionSize;
+		int numRegions;
+		int currentRegion;
+		//Region bindRange last bound, -1 for none
+		int boundRegion;
+		bool persistent;
+
+		char *mappedData;
+		GLsync *fences;
+
+		//Only used on the fallback path
+		char *stagingData;
+		GLsizeiptr stagingSize;
+
+};
@@ -0,0 +1,407 @@
+#include "SceneCache.h"
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+static const char CACHE_MAGIC[8] = { 'R', 'C', 'S', 'C', 'E', 'N', 'E', 0 };
+
+
+SceneCache::SceneCache()
+{
+	data = nullptr;
+	size = 0;
+	file = nullptr;
+	mapping = nullptr;
+}
+
+bool SceneCache::open(std::string modelPath)
+{
+	close();
+
+	std::string cachePath = getCachePath(modelPath);
+	if (!map(cachePath))
+	{
+		return false;
+	}
+
+	bool touched = false;
+	if (!validate(modelPath, &touched))
+	{
+		close();
+		return false;
+	}
+
+	//Record the new time so later starts don't have to hash the model again.
+	//The file is unmapped first as Windows won't write to a mapped file
+	if (touched)
+	{
+		uint64_t sourceSize;
+		int64_t sourceModified;
+		close();
+		if (!getSourceInfo(modelPath, &sourceSize, &sourceModified) || !updateSourceModified(cachePath, sourceModified))
+		{
+			std::cout << "Could not update scene cache time: " << cachePath << std::endl;
+		}
+		if (!map(cachePath))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void SceneCache::close()
+{
+#ifdef _WIN32
+	if (data != nullptr)
+	{
+		UnmapViewOfFile(data);
+	}
+	if (mapping != nullptr)
+	{
+		CloseHandle(mapping);
+	}
+	if (file != nullptr)
+	{
+		CloseHandle(file);
+	}
+#else
+	if (data != nullptr)
+	{
+		munmap((void*)data, size);
+	}
+#endif
+
+	data = nullptr;
+	size = 0;
+	file = nullptr;
+	mapping = nullptr;
+}
+
+bool SceneCache::map(std::string path)
+{
+#ifdef _WIN32
+	HANDLE fileHandle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (fileHandle == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+	file = fileHandle;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(fileHandle, &fileSize) || fileSize.QuadPart < sizeof(Header))
+	{
+		close();
+		return false;
+	}
+
+	mapping = CreateFileMappingA(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping == nullptr)
+	{
+		close();
+		return false;
+	}
+
+	data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (data == nullptr)
+	{
+		close();
+		return false;
+	}
+	size = fileSize.QuadPart;
+#else
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		return false;
+	}
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(Header))
+	{
+		::close(fd);
+		return false;
+	}
+
+	//The mapping stays valid after the descriptor is closed
+	void *mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (mapped == MAP_FAILED)
+	{
+		return false;
+	}
+
+	data = (const char*)mapped;
+	size = info.st_size;
+#endif
+
+	return true;
+}
+
+bool SceneCache::validate(std::string modelPath, bool *touched)
+{
+	const Header *header = getHeader();
+	if (memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 || header->version != VERSION || header->fileSize != size)
+	{
+		return false;
+	}
+
+	//Every section has to lie inside the file
+	if (header->positionsOffset + header->numVertices * sizeof(glm::vec3) > size ||
+		header->attributesOffset + header->numVertices * sizeof(VertexAttributes) > size ||
+		header->indicesOffset + header->numIndices * sizeof(GLuint) > size ||
+		header->nodesOffset + header->numNodes * sizeof(BVHNode) > size ||
+		header->materialsOffset + header->numMaterials * sizeof(Material) > size ||
+		header->texturesOffset > size)
+	{
+		return false;
+	}
+
+	uint64_t sourceSize;
+	int64_t sourceModified;
+	if (!getSourceInfo(modelPath, &sourceSize, &sourceModified) || sourceSize != header->sourceSize)
+	{
+		return false;
+	}
+
+	//A copied or touched model gets a new time, only rehash it then
+	if (sourceModified != header->sourceModified)
+	{
+		if (hashFile(modelPath) != header->sourceHash)
+		{
+			return false;
+		}
+		*touched = true;
+	}
+
+	return true;
+}
+
+bool SceneCache::updateSourceModified(std::string path, int64_t modified)
+{
+	std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+	if (!file.is_open())
+	{
+		return false;
+	}
+
+	file.seekp(offsetof(Header, sourceModified));
+	file.write((const char*)&modified, sizeof(modified));
+	return (bool)file;
+}
+
+bool SceneCache::write(std::string modelPath, ArrayView<glm::vec3> positions, ArrayView<VertexAttributes> attributes,
+	ArrayView<GLuint> indices, ArrayView<BVHNode> nodes, ArrayView<Material> materials, const std::vector<Texture> &textures)
+{
+	Header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	header.version = VERSION;
+	if (!getSourceInfo(modelPath, &header.sourceSize, &header.sourceModified))
+	{
+		return false;
+	}
+	header.sourceHash = hashFile(modelPath);
+
+	//Sections are aligned so the mapped arrays can be read in place
+	uint64_t offset = sizeof(Header);
+	auto align = [](uint64_t x) { return (x + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT; };
+
+	header.numVertices = positions.size();
+	header.positionsOffset = align(offset);
+	offset = header.positionsOffset + positions.sizeBytes();
+	header.attributesOffset = align(offset);
+	offset = header.attributesOffset + attributes.sizeBytes();
+	header.numIndices = indices.size();
+	header.indicesOffset = align(offset);
+	offset = header.indicesOffset + indices.sizeBytes();
+	header.numNodes = nodes.size();
+	header.nodesOffset = align(offset);
+	offset = header.nodesOffset + nodes.sizeBytes();
+	header.numMaterials = materials.size();
+	header.materialsOffset = align(offset);
+	offset = header.materialsOffset + materials.sizeBytes();
+	header.numTextures = textures.size();
+	header.texturesOffset = align(offset);
+	offset = header.texturesOffset;
+
+	std::vector<char> textureData;
+	for (int i = 0; i < textures.size(); i++)
+	{
+		std::string strings[2] = { textures[i].path.C_Str(), textures[i].type };
+		for (int s = 0; s < 2; s++)
+		{
+			uint32_t length = strings[s].size();
+			textureData.insert(textureData.end(), (char*)&length, (char*)&length + sizeof(length));
+			textureData.insert(textureData.end(), strings[s].begin(), strings[s].end());
+		}
+	}
+	header.fileSize = offset + textureData.size();
+
+	//Written beside the real cache and renamed over it so a reader never maps a half written file
+	std::string cachePath = getCachePath(modelPath);
+	std::string tempPath = cachePath + ".tmp";
+	std::ofstream out(tempPath, std::ios::binary);
+	if (!out.is_open())
+	{
+		return false;
+	}
+
+	auto writeSection = [&out](uint64_t sectionOffset, const void *bytes, size_t count)
+	{
+		static const char padding[SECTION_ALIGNMENT] = { 0 };
+		out.write(padding, sectionOffset - (uint64_t)out.tellp());
+		if (count > 0)
+		{
+			out.write((const char*)bytes, count);
+		}
+	};
+
+	out.write((const char*)&header, sizeof(header));
+	writeSection(header.positionsOffset, positions.data(), positions.sizeBytes());
+	writeSection(header.attributesOffset, attributes.data(), attributes.sizeBytes());
+	writeSection(header.indicesOffset, indices.data(), indices.sizeBytes());
+	writeSection(header.nodesOffset, nodes.data(), nodes.sizeBytes());
+	writeSection(header.materialsOffset, materials.data(), materials.sizeBytes());
+	writeSection(header.texturesOffset, textureData.data(), textureData.size());
+	out.close();
+
+	if (out.fail())
+	{
+		std::remove(tempPath.c_str());
+		return false;
+	}
+
+	std::remove(cachePath.c_str());
+	return std::rename(tempPath.c_str(), cachePath.c_str()) == 0;
+}
+
+ArrayView<glm::vec3> SceneCache::getVertexPositions()
+{
+	const Header *header = getHeader();
+	return ArrayView<glm::vec3>((const glm::vec3*)(data + header->positionsOffset), header->numVertices);
+}
+
+ArrayView<VertexAttributes> SceneCache::getVertexAttributes()
+{
+	const Header *header = getHeader();
+	return ArrayView<VertexAttributes>((const VertexAttributes*)(data + header->attributesOffset), header->numVertices);
+}
+
+ArrayView<GLuint> SceneCache::getIndices()
+{
+	const Header *header = getHeader();
+	return ArrayView<GLuint>((const GLuint*)(data + header->indicesOffset), header->numIndices);
+}
+
+ArrayView<BVHNode> SceneCache::getBVHNodes()
+{
+	const Header *header = getHeader();
+	return ArrayView<BVHNode>((const BVHNode*)(data + header->nodesOffset), header->numNodes);
+}
+
+ArrayView<Material> SceneCache::getMaterials()
+{
+	const Header *header = getHeader();
+	return ArrayView<Material>((const Material*)(data + header->materialsOffset), header->numMaterials);
+}
+
+std::vector<Texture> SceneCache::getTextures()
+{
+	const Header *header = getHeader();
+	std::vector<Texture> textures;
+
+	const char *p = data + header->texturesOffset;
+	const char *end = data + size;
+	for (int i = 0; i < header->numTextures; i++)
+	{
+		std::string strings[2];
+		for (int s = 0; s < 2; s++)
+		{
+			uint32_t length;
+			if (p + sizeof(length) > end)
+			{
+				return textures;
+			}
+			memcpy(&length, p, sizeof(length));
+			p += sizeof(length);
+			if (p + length > end)
+			{
+				return textures;
+			}
+			strings[s] = std::string(p, length);
+			p += length;
+		}
+
+		Texture texture;
+		texture.id = 0;
+		texture.path = aiString(strings[0]);
+		texture.type = strings[1];
+		textures.push_back(texture);
+	}
+
+	return textures;
+}
+
+const SceneCache::Header* SceneCache::getHeader()
+{
+	return (const Header*)data;
+}
+
+std::string SceneCache::getCachePath(std::string modelPath)
+{
+	return modelPath + ".rccache";
+}
+
+bool SceneCache::getSourceInfo(std::string path, uint64_t *size, int64_t *modified)
+{
+	struct stat info;
+	if (path == "" || stat(path.c_str(), &info) != 0)
+	{
+		return false;
+	}
+
+	*size = info.st_size;
+	*modified = info.st_mtime;
+	return true;
+}
+
+uint64_t SceneCache::hashFile(std::string path)
+{
+	//64 bit FNV-1a over the whole file
+	uint64_t hash = 14695981039346656037ULL;
+	std::ifstream in(path, std::ios::binary);
+	std::vector<char> buffer(1 << 20);
+	while (in)
+	{
+		in.read(&buffer[0], buffer.size());
+		std::streamsize count = in.gcount();
+		for (std::streamsize i = 0; i < count; i++)
+		{
+			hash ^= (unsigned char)buffer[i];
+			hash *= 1099511628211ULL;
+		}
+	}
+	return hash;
+}
+
+SceneCache::~SceneCache()
+{
+	close();
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+#include "ArrayView.h"
+#include "Model.h"
+#include "BVH.h"
+
+//Binary cache of an imported model, written next to it as <model>.rccache so
+//later starts skip Assimp. It holds the vertex, index, BVH and material buffers
+//exactly as they are uploaded plus the texture references. The file is memory mapped
+//and the getters return views straight into the mapping, so the buffers can
+//be handed to glBufferData without a copy. A cache is only used while the
+//model's size and modification time match, or its contents hash does.
+class SceneCache
+{
+	public:
+		SceneCache();
+		~SceneCache();
+
+		//Maps the cache for the model, false if there is none or it is stale
+		bool open(std::string modelPath);
+		void close();
+
+		static bool write(std::string modelPath, ArrayView<glm::vec3> positions, ArrayView<VertexAttributes> attributes,
+			ArrayView<GLuint> indices, ArrayView<BVHNode> nodes, ArrayView<Material> materials, const std::vector<Texture> &textures);
+
+		ArrayView<glm::vec3> getVertexPositions();
+		ArrayView<VertexAttributes> getVertexAttributes();
+		ArrayView<GLuint> getIndices();
+		ArrayView<BVHNode> getBVHNodes();
+		ArrayView<Material> getMaterials();
+		//Texture paths and types in id order, the ids are not set
+		std::vector<Texture> getTextures();
+
+	protected:
+		//Bump whenever the header or any cached struct changes layout
+		static const uint32_t VERSION = 5;
+		static const uint64_t SECTION_ALIGNMENT = 16;
+
+		struct Header {
+			char magic[8];
+			uint32_t version;
+			uint32_t numTextures;
+			uint64_t sourceSize;
+			int64_t sourceModified;
+			uint64_t sourceHash;
+			uint64_t positionsOffset;
+			uint64_t numVertices;
+			uint64_t attributesOffset;
+			uint64_t indicesOffset;
+			uint64_t numIndices;
+			uint64_t nodesOffset;
+			uint64_t numNodes;
+			uint64_t materialsOffset;
+			uint64_t numMaterials;
+			uint64_t texturesOffset;
+			uint64_t fileSize;
+		};
+
+		static std::string getCachePath(std::string modelPath);
+		static bool getSourceInfo(std::string path, uint64_t *size, int64_t *modified);
+		static uint64_t hashFile(std::string path);
+		//Rewrites only the header's sourceModified, the rest of the cache is untouched
+		static bool updateSourceModified(std::string path, int64_t modified);
+
+		bool map(std::string path);
+		//touched is set when the model's time changed but its contents hash still matches
+		bool validate(std::string modelPath, bool *touched);
+		const Header* getHeader();
+
+		const char *data;
+		size_t size;
+		//Windows handles of the open mapping, POSIX only needs the mapped range
+		void *file;
+		void *mapping;
+
+};
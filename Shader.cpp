@@ -1,12 +1,14 @@
 #include "Shader.h"
 
+#include <cstdio>
+#include <iterator>
 
 
+
+bool Shader::binaryCache = true;
+
 Shader::Shader()
 {
-	vertexShaderSet = false;
-	fragmentShaderSet = false;
-	computeShaderSet = false;
 	shaderProgram = glCreateProgram();
 }
 
@@ -15,28 +17,96 @@ GLuint Shader::getShaderProgram()
 	return shaderProgram;
 }
 
-void Shader::createShader(const char* shaderPath, int shaderType)
+void Shader::setBinaryCache(bool enabled)
 {
-	// Create the shaders
-	GLuint shaderID = glCreateShader(shaderType);
+	binaryCache = enabled;
+}
 
-	// Read the shader code from the file
+std::string Shader::getDriverString()
+{
+	std::string driver;
+	GLenum names[3] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+	for (int i = 0; i < 3; i++)
+	{
+		const GLubyte *name = glGetString(names[i]);
+		driver += (i > 0 ? "|" : "") + std::string(name != nullptr ? (const char*)name : "");
+	}
+	return driver;
+}
+
+std::string Shader::readSource(std::string shaderPath)
+{
 	std::string shaderCode;
-	std::ifstream shaderStream(shaderPath, std::ios::in);
-	if (shaderStream.is_open())
+	std::ifstream shaderStream(shaderPath, std::ios::in | std::ios::binary);
+	if (!shaderStream.is_open())
+	{
+		printf("Could not open shader : %s\n", shaderPath.c_str());
+		return shaderCode;
+	}
+
+	//Read in one go, then copy whole runs of lines between the includes
+	std::string contents((std::istreambuf_iterator<char>(shaderStream)), std::istreambuf_iterator<char>());
+	shaderStream.close();
+	shaderCode.reserve(contents.size());
+
+	std::string directory = shaderPath.substr(0, shaderPath.find_last_of("/\\") + 1);
+	size_t copied = 0;
+	size_t lineStart = 0;
+	while (lineStart < contents.size())
 	{
-		std::string line = "";
-		while (getline(shaderStream, line))
-			shaderCode += "\n" + line;
-		shaderStream.close();
+		size_t lineEnd = contents.find('\n', lineStart);
+		lineEnd = lineEnd != std::string::npos ? lineEnd + 1 : contents.size();
+
+		//GLSL has no includes of its own
+		if (contents.compare(lineStart, 8, "#include") == 0)
+		{
+			size_t first = contents.find('"', lineStart);
+			size_t last = first < lineEnd ? contents.find('"', first + 1) : std::string::npos;
+			if (last < lineEnd)
+			{
+				shaderCode.append(contents, copied, lineStart - copied);
+				shaderCode += readSource(directory + contents.substr(first + 1, last - first - 1));
+				if (shaderCode.size() > 0 && shaderCode.back() != '\n')
+				{
+					shaderCode += '\n';
+				}
+				copied = lineEnd;
+			}
+		}
+		lineStart = lineEnd;
 	}
+	shaderCode.append(contents, copied, std::string::npos);
+
+	return shaderCode;
+}
+
+void Shader::createShader(const char* shaderPath, int shaderType, std::string defines)
+{
+	// Read the shader code from the file
+	std::string shaderCode = readSource(shaderPath);
+
+	//Defines have to come after #version
+	if (defines != "")
+	{
+		size_t version = shaderCode.find("#version");
+		size_t lineEnd = version != std::string::npos ? shaderCode.find('\n', version) : std::string::npos;
+		shaderCode.insert(lineEnd != std::string::npos ? lineEnd + 1 : 0, defines);
+	}
+
+	sources.push_back({ shaderType, shaderPath, defines, shaderCode });
+}
+
+GLuint Shader::compileShader(const ShaderSource &source)
+{
+	// Create the shaders
+	GLuint shaderID = glCreateShader(source.type);
 
 	GLint result = GL_FALSE;
 	int infoLogLength;
 
 	// Compile shader
-	printf("Compiling shader : %s\n", shaderPath);
-	char const * sourcePointer = shaderCode.c_str();
+	printf("Compiling shader : %s\n", source.path.c_str());
+	char const * sourcePointer = source.code.c_str();
 	glShaderSource(shaderID, 1, &sourcePointer, NULL);
 	glCompileShader(shaderID);
 
@@ -50,41 +120,122 @@ void Shader::createShader(const char* shaderPath, int shaderType)
 		fprintf(stdout, "%s\n", &shaderErrorMessage[0]);
 	}
 
-	if (shaderType == GL_VERTEX_SHADER)
+	return shaderID;
+}
+
+uint64_t Shader::hashText(uint64_t hash, const std::string &text)
+{
+	for (size_t i = 0; i < text.size() + 1; i++)
+	{
+		hash ^= (unsigned char)text.c_str()[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+std::string Shader::getBinaryPath()
+{
+	//Only what picks the program, not its contents, so edits reuse the same file
+	uint64_t hash = 14695981039346656037ULL;
+	for (const ShaderSource &source : sources)
+	{
+		hash = hashText(hash, std::to_string(source.type));
+		hash = hashText(hash, source.path);
+		hash = hashText(hash, source.defines);
+	}
+
+	char hex[17];
+	snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)hash);
+	return sources[0].path + "." + hex + ".rcprog";
+}
+
+uint64_t Shader::getSourceHash()
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (const ShaderSource &source : sources)
+	{
+		hash = hashText(hash, std::to_string(source.type));
+		hash = hashText(hash, source.code);
+	}
+	return hashText(hash, getDriverString());
+}
+
+bool Shader::loadBinary(std::string path, uint64_t sourceHash)
+{
+	std::ifstream in(path, std::ios::binary);
+	uint64_t savedHash;
+	GLenum format;
+	if (!in.read((char*)&savedHash, sizeof(savedHash)) || savedHash != sourceHash)
 	{
-		vertexShaderSet = true;
-		vertexShader = shaderID;
+		return false;
 	}
-	else if (shaderType == GL_FRAGMENT_SHADER)
+	if (!in.read((char*)&format, sizeof(format)))
 	{
-		fragmentShaderSet = true;
-		fragmentShader = shaderID;
+		return false;
 	}
-	else if (shaderType == GL_COMPUTE_SHADER)
+	std::vector<char> binary((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	if (binary.size() == 0)
 	{
-		computeShaderSet = true;
-		computeShader = shaderID;
+		return false;
 	}
+
+	//A driver may reject binaries from its older versions, the program is then just unlinked
+	glProgramBinary(shaderProgram, format, &binary[0], (GLsizei)binary.size());
+	GLint result = GL_FALSE;
+	glGetProgramiv(shaderProgram, GL_LINK_STATUS, &result);
+	return result == GL_TRUE;
 }
 
-void Shader::createProgram()
+void Shader::saveBinary(std::string path, uint64_t sourceHash)
 {
+	GLint length = 0;
+	glGetProgramiv(shaderProgram, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+	{
+		return;
+	}
 
-	// Link the program
-	fprintf(stdout, "Linking program\n");
-	if (vertexShaderSet)
+	std::vector<char> binary(length);
+	GLenum format;
+	glGetProgramBinary(shaderProgram, length, &length, &format, &binary[0]);
+
+	//Replaces the binary of any older sources with the same defines
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	out.write((const char*)&sourceHash, sizeof(sourceHash));
+	out.write((const char*)&format, sizeof(format));
+	out.write(&binary[0], length);
+	if (!out)
 	{
-		glAttachShader(shaderProgram, vertexShader);
+		printf("Could not write program binary : %s\n", path.c_str());
 	}
+}
 
-	if (fragmentShaderSet)
+void Shader::createProgram()
+{
+	std::string binaryPath = binaryCache && sources.size() > 0 ? getBinaryPath() : "";
+	uint64_t sourceHash = binaryPath != "" ? getSourceHash() : 0;
+	if (binaryPath != "" && loadBinary(binaryPath, sourceHash))
 	{
-		glAttachShader(shaderProgram, fragmentShader);
+		fprintf(stdout, "Loaded program binary : %s\n", binaryPath.c_str());
+		sources.clear();
+		return;
 	}
 
-	if (computeShaderSet)
+	std::vector<GLuint> shaders;
+	for (const ShaderSource &source : sources)
+	{
+		shaders.push_back(compileShader(source));
+	}
+
+	// Link the program
+	fprintf(stdout, "Linking program\n");
+	for (GLuint shader : shaders)
+	{
+		glAttachShader(shaderProgram, shader);
+	}
+	if (binaryPath != "")
 	{
-		glAttachShader(shaderProgram, computeShader);
+		glProgramParameteri(shaderProgram, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 	}
 	glLinkProgram(shaderProgram);
 
@@ -98,21 +249,76 @@ void Shader::createProgram()
 	glGetProgramInfoLog(shaderProgram, infoLogLength, NULL, &programErrorMessage[0]);
 	fprintf(stdout, "%s\n", &programErrorMessage[0]);
 
-	if (vertexShaderSet)
+	for (GLuint shader : shaders)
 	{
-		glDeleteShader(vertexShader);
+		glDetachShader(shaderProgram, shader);
+		glDeleteShader(shader);
 	}
+	sources.clear();
 
-	if (fragmentShaderSet)
+	if (result == GL_TRUE && binaryPath != "")
 	{
-		glDeleteShader(fragmentShader);
+		saveBinary(binaryPath, sourceHash);
 	}
+}
 
-	if (computeShaderSet)
+std::vector<Shader::SharedUniform> Shader::findSharedUniforms(GLuint program)
+{
+	std::vector<SharedUniform> uniforms;
+	GLint count = 0;
+	glGetProgramiv(shaderProgram, GL_ACTIVE_UNIFORMS, &count);
+	for (int i = 0; i < count; i++)
 	{
-		glDeleteShader(computeShader);
+		GLchar name[64];
+		GLint size;
+		GLenum type;
+		glGetActiveUniform(shaderProgram, i, sizeof(name), nullptr, &size, &type, name);
+
+		//Samplers keep their layout binding
+		if (type != GL_INT && type != GL_BOOL && type != GL_INT_VEC2 && type != GL_FLOAT_VEC3)
+		{
+			continue;
+		}
+
+		SharedUniform uniform;
+		uniform.from = glGetUniformLocation(program, name);
+		uniform.to = glGetUniformLocation(shaderProgram, name);
+		uniform.type = type;
+		if (uniform.from >= 0 && uniform.to >= 0)
+		{
+			uniforms.push_back(uniform);
+		}
 	}
+	return uniforms;
+}
 
+void Shader::copyUniforms(GLuint program, const std::vector<SharedUniform> &uniforms)
+{
+	for (const SharedUniform &uniform : uniforms)
+	{
+		GLint ints[4];
+		GLfloat floats[4];
+		if (uniform.type == GL_INT || uniform.type == GL_BOOL)
+		{
+			glGetUniformiv(program, uniform.from, ints);
+			glProgramUniform1i(shaderProgram, uniform.to, ints[0]);
+		}
+		else if (uniform.type == GL_INT_VEC2)
+		{
+			glGetUniformiv(program, uniform.from, ints);
+			glProgramUniform2iv(shaderProgram, uniform.to, 1, ints);
+		}
+		else
+		{
+			glGetUniformfv(program, uniform.from, floats);
+			glProgramUniform3fv(shaderProgram, uniform.to, 1, floats);
+		}
+	}
+}
+
+void Shader::copyUniforms(GLuint program)
+{
+	this->copyUniforms(program, this->findSharedUniforms(program));
 }
 
 Shader::~Shader()
@@ -8,7 +8,14 @@
 #include <vector>
 #include <string>
 #include <algorithm>
+#include <cstdint>
 
+//Linked programs are saved with glGetProgramBinary next to their first shader
+//as <shader>.<hash>.rcprog, the name hashing only each stage's path and
+//defines so a rebuilt program overwrites its old file. The file starts with a
+//hash of every source after includes plus the driver's vendor, renderer and
+//version, a later createProgram loads the binary only if that still matches
+//and compiles if it doesn't or the driver rejects it.
 class Shader
 {
 
@@ -18,18 +25,53 @@ public:
 
 	GLuint getShaderProgram();
 
-	void createShader(const char* shaderPath, int shaderType);
+	//defines are added after the #version line, e.g. "#define NAME\n". The
+	//source is compiled by createProgram, unless a cached binary is used
+	void createShader(const char* shaderPath, int shaderType, std::string defines = "");
 	void createProgram();
+	//An active int, bool, ivec2 or vec3 uniform, located in another program and this one
+	struct SharedUniform {
+		GLint from;
+		GLint to;
+		GLenum type;
+	};
+
+	//Uniforms copyUniforms can take from program, looked up by name
+	std::vector<SharedUniform> findSharedUniforms(GLuint program);
+	//Sets each of uniforms to its value in program, for programs built from
+	//the same source with different defines
+	void copyUniforms(GLuint program, const std::vector<SharedUniform> &uniforms);
+	void copyUniforms(GLuint program);
+
+	//On by default, off compiles every program from source
+	static void setBinaryCache(bool enabled);
+	//GL_VENDOR, GL_RENDERER and GL_VERSION separated by '|'
+	static std::string getDriverString();
 
 protected:
-	GLuint shaderProgram;
-	GLuint vertexShader;
-	GLuint fragmentShader;
-	GLuint computeShader;
+	struct ShaderSource {
+		int type;
+		std::string path;
+		std::string defines;
+		std::string code;
+	};
+
+	//Reads the source of a shader, expanding each #include "file" line with
+	//the file it names, relative to the including file
+	std::string readSource(std::string shaderPath);
+	GLuint compileShader(const ShaderSource &source);
+	//64 bit FNV-1a of text, including its terminator, continuing from hash
+	static uint64_t hashText(uint64_t hash, const std::string &text);
+	std::string getBinaryPath();
+	uint64_t getSourceHash();
+	bool loadBinary(std::string path, uint64_t sourceHash);
+	void saveBinary(std::string path, uint64_t sourceHash);
 
-	bool vertexShaderSet;
-	bool fragmentShaderSet;
-	bool computeShaderSet;
+	static bool binaryCache;
+
+	std::vector<ShaderSource> sources;
+
+	GLuint shaderProgram;
 
 };
 
@@ -0,0 +1,173 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+//Index of the worker owned by the current thread, -1 for threads outside the pool
+static thread_local int workerIndex = -1;
+static thread_local ThreadPool *workerPool = nullptr;
+
+
+ThreadPool::ThreadPool(int numThreads)
+{
+	if (numThreads <= 0)
+	{
+		numThreads = std::max(1, (int)std::thread::hardware_concurrency());
+	}
+
+	queued = 0;
+	nextQueue = 0;
+	stopping = false;
+
+	for (int i = 0; i < numThreads; i++)
+	{
+		workers.push_back(new Worker());
+	}
+
+	for (int i = 0; i < numThreads; i++)
+	{
+		threads.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+	}
+}
+
+void ThreadPool::submit(TaskGroup *group, std::function<void()> task)
+{
+	group->pending++;
+
+	//Workers keep their own spawned tasks local, everyone else spreads them round-robin
+	int index = workerIndex;
+	if (workerPool != this || index < 0)
+	{
+		index = nextQueue++ % workers.size();
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(workers[index]->mutex);
+		workers[index]->tasks.push_back({ task, group });
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		queued++;
+	}
+	sleepCondition.notify_one();
+}
+
+void ThreadPool::wait(TaskGroup *group)
+{
+	int index = workerPool == this ? workerIndex : -1;
+
+	while (group->pending > 0)
+	{
+		Task task;
+		if (popTask(index, &task))
+		{
+			runTask(&task);
+		}
+		else
+		{
+			std::this_thread::yield();
+		}
+	}
+}
+
+void ThreadPool::parallelFor(int begin, int end, int grainSize, std::function<void(int, int)> func)
+{
+	grainSize = std::max(1, grainSize);
+
+	TaskGroup group;
+	for (int first = begin; first < end; first += grainSize)
+	{
+		int last = std::min(end, first + grainSize);
+		submit(&group, [func, first, last]() { func(first, last); });
+	}
+	wait(&group);
+}
+
+int ThreadPool::getThreadCount()
+{
+	return threads.size();
+}
+
+void ThreadPool::workerLoop(int index)
+{
+	workerIndex = index;
+	workerPool = this;
+
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(sleepMutex);
+			sleepCondition.wait(lock, [this]() { return stopping || queued > 0; });
+			if (stopping && queued == 0)
+			{
+				return;
+			}
+		}
+
+		Task task;
+		if (popTask(index, &task))
+		{
+			runTask(&task);
+		}
+	}
+}
+
+bool ThreadPool::popTask(int index, Task *task)
+{
+	//Newest local work first, it is the most likely to still be in cache
+	if (index >= 0)
+	{
+		Worker *worker = workers[index];
+		std::lock_guard<std::mutex> lock(worker->mutex);
+		if (!worker->tasks.empty())
+		{
+			*task = worker->tasks.back();
+			worker->tasks.pop_back();
+			queued--;
+			return true;
+		}
+	}
+
+	//Otherwise steal the oldest work from another worker
+	int numWorkers = workers.size();
+	int start = index >= 0 ? index + 1 : 0;
+	for (int i = 0; i < numWorkers; i++)
+	{
+		Worker *victim = workers[(start + i) % numWorkers];
+		std::lock_guard<std::mutex> lock(victim->mutex);
+		if (!victim->tasks.empty())
+		{
+			*task = victim->tasks.front();
+			victim->tasks.pop_front();
+			queued--;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void ThreadPool::runTask(Task *task)
+{
+	task->func();
+	task->group->pending--;
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		stopping = true;
+	}
+	sleepCondition.notify_all();
+
+	for (int i = 0; i < threads.size(); i++)
+	{
+		threads[i].join();
+	}
+
+	for (int i = 0; i < workers.size(); i++)
+	{
+		delete workers[i];
+	}
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//Counts the outstanding tasks submitted against it so that a caller can wait
+//on just the work it spawned.
+struct TaskGroup {
+	std::atomic<int> pending;
+
+	TaskGroup() : pending(0) {}
+};
+
+//Work-stealing thread pool. Every worker owns a deque; it pops its own work
+//from the back and steals from the front of the other deques when it runs
+//dry. Tasks may submit further tasks and wait on them, waiting threads run
+//queued work rather than block, so recursive builds cannot deadlock.
+class ThreadPool
+{
+	public:
+		ThreadPool(int numThreads = 0);
+		~ThreadPool();
+
+		void submit(TaskGroup *group, std::function<void()> task);
+		void wait(TaskGroup *group);
+
+		//Splits [begin, end) into chunks of at most grainSize and runs func(first, last)
+		//for each chunk across the pool, returning once all chunks are done.
+		void parallelFor(int begin, int end, int grainSize, std::function<void(int, int)> func);
+
+		int getThreadCount();
+
+	protected:
+		struct Task {
+			std::function<void()> func;
+			TaskGroup *group;
+		};
+
+		struct Worker {
+			std::deque<Task> tasks;
+			std::mutex mutex;
+		};
+
+		void workerLoop(int index);
+		bool popTask(int index, Task *task);
+		void runTask(Task *task);
+
+		std::vector<Worker*> workers;
+		std::vector<std::thread> threads;
+
+		std::mutex sleepMutex;
+		std::condition_variable sleepCondition;
+		std::atomic<int> queued;
+		std::atomic<unsigned int> nextQueue;
+		bool stopping;
+
+};
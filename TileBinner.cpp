@@ -0,0 +1,218 @@
+#include "TileBinner.h"
+
+#include <algorithm>
+#include <cmath>
+
+
+TileBinner::TileBinner(ThreadPool *pool)
+{
+	this->pool = pool;
+	width = 0;
+	height = 0;
+	tileWidth = 1;
+	tileHeight = 1;
+	tilesX = 0;
+	tilesY = 0;
+	glGenBuffers(1, &offsetBuffer);
+	glGenBuffers(1, &entryBuffer);
+}
+
+void TileBinner::setScreen(int width, int height, int tileWidth, int tileHeight)
+{
+	this->width = width;
+	this->height = height;
+	this->tileWidth = tileWidth;
+	this->tileHeight = tileHeight;
+	tilesX = (width + tileWidth - 1) / tileWidth;
+	tilesY = (height + tileHeight - 1) / tileHeight;
+}
+
+void TileBinner::binCubes(const cube *cubes, const GLuint *visibleIndices, int numCubes, glm::mat4 vp)
+{
+	ids.resize(numCubes);
+	ranges.resize(numCubes);
+	covered.resize(numCubes);
+
+	pool->parallelFor(0, numCubes, GRAIN_SIZE, [this, cubes, visibleIndices, &vp](int first, int last)
+	{
+		for (int i = first; i < last; i++)
+		{
+			GLuint index = visibleIndices != nullptr ? visibleIndices[i] : i;
+			glm::vec3 lo = glm::vec3(cubes[index].cubeMin);
+			glm::vec3 hi = glm::vec3(cubes[index].cubeMax);
+			glm::vec3 corners[8];
+			for (int c = 0; c < 8; c++)
+			{
+				corners[c] = glm::vec3(c & 1 ? hi.x : lo.x, c & 2 ? hi.y : lo.y, c & 4 ? hi.z : lo.z);
+			}
+
+			ids[i] = index;
+			covered[i] = projectBounds(corners, 8, vp, &ranges[i]);
+		}
+	});
+
+	buildLists();
+}
+
+void TileBinner::binTriangles(ArrayView<glm::vec3> positions, ArrayView<GLuint> indices, glm::mat4 vp)
+{
+	int numTriangles = indices.size() / 3;
+	ids.resize(numTriangles);
+	ranges.resize(numTriangles);
+	covered.resize(numTriangles);
+
+	pool->parallelFor(0, numTriangles, GRAIN_SIZE, [this, positions, indices, &vp](int first, int last)
+	{
+		for (int i = first; i < last; i++)
+		{
+			glm::vec3 corners[3] = { positions[indices[i * 3]], positions[indices[i * 3 + 1]], positions[indices[i * 3 + 2]] };
+			ids[i] = i;
+			covered[i] = projectBounds(corners, 3, vp, &ranges[i]);
+		}
+	});
+
+	buildLists();
+}
+
+bool TileBinner::projectBounds(const glm::vec3 *points, int numPoints, const glm::mat4 &vp, glm::ivec4 *tiles)
+{
+	glm::vec2 ndcMin = glm::vec2(1e30f);
+	glm::vec2 ndcMax = glm::vec2(-1e30f);
+	int behind = 0;
+	for (int i = 0; i < numPoints; i++)
+	{
+		glm::vec4 clip = vp * glm::vec4(points[i], 1.0f);
+		if (clip.w <= 1e-6f)
+		{
+			behind++;
+			continue;
+		}
+
+		glm::vec2 ndc = glm::vec2(clip.x, clip.y) / clip.w;
+		ndcMin = glm::min(ndcMin, ndc);
+		ndcMax = glm::max(ndcMax, ndc);
+	}
+
+	//Eye rays only go forwards, a primitive wholly behind the eye is never hit
+	//and one that crosses the eye plane could be anywhere on screen
+	if (behind == numPoints)
+	{
+		return false;
+	}
+
+	if (behind > 0)
+	{
+		*tiles = glm::ivec4(0, 0, tilesX - 1, tilesY - 1);
+		return true;
+	}
+
+	//Pixel x traces the ray at ndc -1 + 2x / (width - 1), as main() in compute.csh
+	glm::vec2 scale = glm::vec2(width - 1, height - 1) * 0.5f;
+	glm::vec2 pixelMin = (ndcMin + glm::vec2(1.0f)) * scale - glm::vec2(1.0f);
+	glm::vec2 pixelMax = (ndcMax + glm::vec2(1.0f)) * scale + glm::vec2(1.0f);
+	if (pixelMax.x < 0 || pixelMax.y < 0 || pixelMin.x > width - 1 || pixelMin.y > height - 1)
+	{
+		return false;
+	}
+
+	pixelMin = glm::max(pixelMin, glm::vec2(0.0f));
+	pixelMax = glm::min(pixelMax, glm::vec2(width - 1, height - 1));
+	*tiles = glm::ivec4((int)pixelMin.x / tileWidth, (int)pixelMin.y / tileHeight, (int)pixelMax.x / tileWidth, (int)pixelMax.y / tileHeight);
+	return true;
+}
+
+void TileBinner::buildLists()
+{
+	int numTiles = tilesX * tilesY;
+	int numPrimitives = ids.size();
+	int numChunks = std::max(1, (numPrimitives + GRAIN_SIZE - 1) / GRAIN_SIZE);
+
+	//Each chunk counts its own primitives per tile, so no atomics are needed
+	std::vector<GLuint> chunkCounts(numChunks * numTiles, 0);
+	pool->parallelFor(0, numChunks, 1, [this, numPrimitives, numTiles, &chunkCounts](int chunk, int)
+	{
+		GLuint *counts = &chunkCounts[chunk * numTiles];
+		int last = std::min(numPrimitives, (chunk + 1) * GRAIN_SIZE);
+		for (int i = chunk * GRAIN_SIZE; i < last; i++)
+		{
+			if (!covered[i])
+			{
+				continue;
+			}
+
+			for (int y = ranges[i].y; y <= ranges[i].w; y++)
+			{
+				for (int x = ranges[i].x; x <= ranges[i].z; x++)
+				{
+					counts[y * tilesX + x]++;
+				}
+			}
+		}
+	});
+
+	//Chunks are laid out in order within each tile, which keeps every list ascending
+	offsets.resize(numTiles + 1);
+	GLuint total = 0;
+	for (int tile = 0; tile < numTiles; tile++)
+	{
+		offsets[tile] = total;
+		for (int chunk = 0; chunk < numChunks; chunk++)
+		{
+			GLuint count = chunkCounts[chunk * numTiles + tile];
+			chunkCounts[chunk * numTiles + tile] = total;
+			total += count;
+		}
+	}
+	offsets[numTiles] = total;
+
+	entries.resize(total);
+	pool->parallelFor(0, numChunks, 1, [this, numPrimitives, numTiles, &chunkCounts](int chunk, int)
+	{
+		GLuint *cursors = &chunkCounts[chunk * numTiles];
+		int last = std::min(numPrimitives, (chunk + 1) * GRAIN_SIZE);
+		for (int i = chunk * GRAIN_SIZE; i < last; i++)
+		{
+			if (!covered[i])
+			{
+				continue;
+			}
+
+			for (int y = ranges[i].y; y <= ranges[i].w; y++)
+			{
+				for (int x = ranges[i].x; x <= ranges[i].z; x++)
+				{
+					entries[cursors[y * tilesX + x]++] = ids[i];
+				}
+			}
+		}
+	});
+}
+
+void TileBinner::upload(GLuint offsetsBinding, GLuint indicesBinding)
+{
+	//The lists change size every time, so the storage is orphaned rather than mapped
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, offsetBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * offsets.size(), offsets.data(), GL_STREAM_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, entryBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * std::max<size_t>(entries.size(), 1), entries.size() > 0 ? entries.data() : nullptr, GL_STREAM_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, offsetsBinding, offsetBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, indicesBinding, entryBuffer);
+}
+
+int TileBinner::getTilesX()
+{
+	return tilesX;
+}
+
+int TileBinner::getEntryCount()
+{
+	return entries.size();
+}
+
+TileBinner::~TileBinner()
+{
+	glDeleteBuffers(1, &offsetBuffer);
+	glDeleteBuffers(1, &entryBuffer);
+}
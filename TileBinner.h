@@ -0,0 +1,65 @@
+#pragma once
+
+#include <vector>
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+#include "ArrayView.h"
+#include "CpuRaycaster.h"
+#include "ThreadPool.h"
+
+//Sorts primitives into the screen tiles their projected bounds overlap, so a
+//primary ray only has to test the primitives listed for its own tile. Bounds
+//are projected with the view projection the eye rays are built from and are
+//padded by a pixel, so a list never misses a primitive the ray could hit.
+//Tile i owns indices[offsets[i]] up to indices[offsets[i + 1]], each list in
+//ascending primitive order so the closest hit matches a full search on ties.
+class TileBinner
+{
+	public:
+		TileBinner(ThreadPool *pool);
+		~TileBinner();
+
+		void setScreen(int width, int height, int tileWidth, int tileHeight);
+
+		//visibleIndices picks the cubes to bin as in CpuRaycaster::setCubes, nullptr bins all of them
+		void binCubes(const cube *cubes, const GLuint *visibleIndices, int numCubes, glm::mat4 vp);
+		void binTriangles(ArrayView<glm::vec3> positions, ArrayView<GLuint> indices, glm::mat4 vp);
+
+		//Sends the lists to two shader storage buffers and binds them
+		void upload(GLuint offsetsBinding, GLuint indicesBinding);
+
+		int getTilesX();
+		int getEntryCount();
+
+	protected:
+		//Primitives handled per task
+		static const int GRAIN_SIZE = 4096;
+
+		//Tile range a primitive covers, false if it cannot be hit by an eye ray
+		bool projectBounds(const glm::vec3 *points, int numPoints, const glm::mat4 &vp, glm::ivec4 *tiles);
+		void buildLists();
+
+		ThreadPool *pool;
+
+		int width;
+		int height;
+		int tileWidth;
+		int tileHeight;
+		int tilesX;
+		int tilesY;
+
+		//Per primitive: its index and tile range, x and y of the first tile then of the last
+		std::vector<GLuint> ids;
+		std::vector<glm::ivec4> ranges;
+		std::vector<char> covered;
+
+		std::vector<GLuint> offsets;
+		std::vector<GLuint> entries;
+
+		GLuint offsetBuffer;
+		GLuint entryBuffer;
+
+};
@@ -0,0 +1,139 @@
+#include "Wavefront.h"
+
+#include <string>
+
+//std430 sizes of WaveRay, WaveHit and WaveShadow in wavefront.csh
+static const GLsizeiptr WAVE_RAY_SIZE = 32;
+static const GLsizeiptr WAVE_HIT_SIZE = 24;
+static const GLsizeiptr WAVE_SHADOW_SIZE = 48;
+//Accumulated vec4 colour of each pixel
+static const GLsizeiptr PIXEL_COLOUR_SIZE = sizeof(GLfloat) * 4;
+
+
+Wavefront::Wavefront(int width, int height, GLuint program)
+{
+	this->width = width;
+	this->height = height;
+	sourceProgram = program;
+
+	const char *stageDefines[NUM_STAGES] = { "STAGE_GENERATE", "STAGE_ARGS", "STAGE_INTERSECT", "STAGE_SHADE", "STAGE_SHADOW", "STAGE_RESOLVE" };
+	for (int i = 0; i < NUM_STAGES; i++)
+	{
+		stages[i].createShader("wavefront.csh", GL_COMPUTE_SHADER, "#define " + std::string(stageDefines[i]) + "\n");
+		stages[i].createProgram();
+		queueUniforms[i] = glGetUniformLocation(stages[i].getShaderProgram(), "QUEUE");
+		depthUniforms[i] = glGetUniformLocation(stages[i].getShaderProgram(), "DEPTH");
+		reflectionDepthUniforms[i] = glGetUniformLocation(stages[i].getShaderProgram(), "REFLECTION_DEPTH");
+		pixelStepUniforms[i] = glGetUniformLocation(stages[i].getShaderProgram(), "PIXEL_STEP");
+		pixelOffsetUniforms[i] = glGetUniformLocation(stages[i].getShaderProgram(), "PIXEL_OFFSET");
+		fillBlockUniforms[i] = glGetUniformLocation(stages[i].getShaderProgram(), "FILL_BLOCK");
+		sharedUniforms[i] = stages[i].findSharedUniforms(program);
+	}
+
+	glGetProgramiv(stages[GENERATE].getShaderProgram(), GL_COMPUTE_WORK_GROUP_SIZE, pixelGroupSize);
+
+	//Every pixel has at most one ray in flight, so no queue outgrows the pixel count
+	GLsizeiptr pixels = (GLsizeiptr)width * height;
+	GLsizeiptr sizes[4] = { WAVE_RAY_SIZE * pixels * 2, WAVE_HIT_SIZE * pixels, WAVE_SHADOW_SIZE * pixels, PIXEL_COLOUR_SIZE * pixels };
+	GLuint *buffers[4] = { &rayBuffer, &hitBuffer, &shadowBuffer, &colourBuffer };
+	for (int i = 0; i < 4; i++)
+	{
+		glGenBuffers(1, buffers[i]);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, *buffers[i]);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, sizes[i], nullptr, GL_DYNAMIC_COPY);
+	}
+
+	glGenBuffers(1, &counterBuffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, counterBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * 4 * 3, nullptr, GL_DYNAMIC_COPY);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void Wavefront::copyUniforms()
+{
+	for (int stage = 0; stage < NUM_STAGES; stage++)
+	{
+		stages[stage].copyUniforms(sourceProgram, sharedUniforms[stage]);
+	}
+}
+
+void Wavefront::setQueue(Stage stage, int queue, int depth)
+{
+	glUseProgram(stages[stage].getShaderProgram());
+	glUniform1i(queueUniforms[stage], queue);
+	glUniform1i(depthUniforms[stage], depth);
+}
+
+void Wavefront::dispatchIndirect(Stage stage, int queue, int depth)
+{
+	setQueue(stage, queue, depth);
+	glDispatchComputeIndirect(sizeof(GLuint) * 4 * queue);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+void Wavefront::render(int pixelStep, int pixelOffsetX, int pixelOffsetY, bool fillBlock, int depth)
+{
+	//These change every refinement pass, so they are set here rather than copied
+	for (int stage = 0; stage < NUM_STAGES; stage++)
+	{
+		GLuint program = stages[stage].getShaderProgram();
+		glProgramUniform1i(program, pixelStepUniforms[stage], pixelStep);
+		glProgramUniform2i(program, pixelOffsetUniforms[stage], pixelOffsetX, pixelOffsetY);
+		glProgramUniform1i(program, fillBlockUniforms[stage], fillBlock);
+	}
+
+	//One invocation per pixelStep square, rounded up to whole groups
+	int groupsX = ((width + pixelStep - 1) / pixelStep + pixelGroupSize[0] - 1) / pixelGroupSize[0];
+	int groupsY = ((height + pixelStep - 1) / pixelStep + pixelGroupSize[1] - 1) / pixelGroupSize[1];
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 14, rayBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 15, hitBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 16, shadowBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 17, colourBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 18, counterBuffer);
+	glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, counterBuffer);
+
+	//Only the first queue needs emptying, each bounce empties the ones it appends to
+	GLuint empty[4] = { 0, 1, 1, 0 };
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, counterBuffer);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(empty), empty);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	glProgramUniform1i(stages[SHADE].getShaderProgram(), reflectionDepthUniforms[SHADE], depth);
+
+	glUseProgram(stages[GENERATE].getShaderProgram());
+	glDispatchCompute(groupsX, groupsY, 1);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+	for (int bounce = 0; bounce <= depth; bounce++)
+	{
+		int queue = bounce % 2;
+
+		//The queue sizes are only known on the GPU, a single invocation turns them into dispatch sizes
+		setQueue(ARGS, queue, bounce);
+		glDispatchCompute(1, 1, 1);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+
+		dispatchIndirect(INTERSECT, queue, bounce);
+		dispatchIndirect(SHADE, queue, bounce);
+
+		setQueue(ARGS, SHADOW_QUEUE, bounce);
+		glDispatchCompute(1, 1, 1);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+
+		dispatchIndirect(SHADOW, SHADOW_QUEUE, bounce);
+	}
+
+	glUseProgram(stages[RESOLVE].getShaderProgram());
+	glDispatchCompute(groupsX, groupsY, 1);
+
+	glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+}
+
+Wavefront::~Wavefront()
+{
+	glDeleteBuffers(1, &rayBuffer);
+	glDeleteBuffers(1, &hitBuffer);
+	glDeleteBuffers(1, &shadowBuffer);
+	glDeleteBuffers(1, &colourBuffer);
+	glDeleteBuffers(1, &counterBuffer);
+}
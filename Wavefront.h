@@ -0,0 +1,67 @@
+#pragma once
+
+#include <GL/glew.h>
+
+#include "Shader.h"
+
+//Traces reflections with the stages in wavefront.csh. Rays are passed from
+//stage to stage in queues that only hold the rays still alive, and each
+//stage after the first is dispatched indirectly with the size of its queue,
+//so the cost of a bounce follows the rays that reach it rather than the
+//pixel count. The stages read the same scene buffers as compute.csh.
+class Wavefront
+{
+	public:
+		//program is the compute shader program the scene uniforms are set on
+		Wavefront(int width, int height, GLuint program);
+		~Wavefront();
+
+		//Copies every uniform the stages share with the compute shader program.
+		//Only needed after its scene uniforms change, render sets the pixel ones
+		void copyUniforms();
+		//Traces the same pixels as compute.csh does for pixelStep, pixelOffset
+		//and fillBlock, following each ray through up to depth reflections. The
+		//framebuffer must be bound to image unit 0
+		void render(int pixelStep, int pixelOffsetX, int pixelOffsetY, bool fillBlock, int depth);
+
+	protected:
+		enum Stage {
+			GENERATE,
+			ARGS,
+			INTERSECT,
+			SHADE,
+			SHADOW,
+			RESOLVE,
+			NUM_STAGES
+		};
+
+		//Must match SHADOW_QUEUE in wavefront.csh
+		static const int SHADOW_QUEUE = 2;
+
+		void setQueue(Stage stage, int queue, int depth);
+		void dispatchIndirect(Stage stage, int queue, int depth);
+
+		Shader stages[NUM_STAGES];
+		GLint queueUniforms[NUM_STAGES];
+		GLint depthUniforms[NUM_STAGES];
+		GLint reflectionDepthUniforms[NUM_STAGES];
+		GLint pixelStepUniforms[NUM_STAGES];
+		GLint pixelOffsetUniforms[NUM_STAGES];
+		GLint fillBlockUniforms[NUM_STAGES];
+
+		GLuint sourceProgram;
+		//Looked up once, the stages and the compute shader program never relink
+		std::vector<Shader::SharedUniform> sharedUniforms[NUM_STAGES];
+
+		int width;
+		int height;
+		//Work group shape of the per-pixel stages, generate and resolve
+		GLint pixelGroupSize[3];
+
+		GLuint rayBuffer;
+		GLuint hitBuffer;
+		GLuint shadowBuffer;
+		GLuint colourBuffer;
+		GLuint counterBuffer;
+
+};
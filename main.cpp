@@ -1,6 +1,8 @@
 #include <iostream>
 #include <fstream>
+#include <chrono>
 #include <math.h> 
+#include <cstdio>
 
 // GLEW
 #define GLEW_STATIC
@@ -22,22 +24,124 @@
 //SOIL
 #include <SOIL/SOIL.h>
 
+//EGL, used to create a surfaceless context for headless runs
+#ifdef __linux__
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#define HEADLESS_EGL
+#endif
+
 #include "Shader.h"
 #include "Quadtree.h"
+#include "Octree.h"
+#include "Frustum.h"
+#include "RingBuffer.h"
+#include "Profiler.h"
 #include "Model.h"
+#include "BVH.h"
+#include "ThreadPool.h"
+#include "CpuRaycaster.h"
+#include "SceneCache.h"
+#include "TileBinner.h"
+#include "Wavefront.h"
 
 #define PI 3.14159265358979323846
 
-struct cube {
-	glm::vec4 cubeMin;
-	glm::vec4 cubeMax;
+struct Config {
+	GLuint width = 512;
+	GLuint height = 384;
+	std::string modelPath = "";
+	int numCubes = 0;
+	bool useQuadtree = false;
+	bool useOctree = false;
+	bool benchmarkCulling = false;
+	bool useBVH = false;
+	bool headless = false;
+	//Frames rendered before a headless run exits, a cube sweep ends on its own
+	int headlessFrames = 1000;
+	//Render with the CPU port of compute.csh instead of the compute shader
+	bool useCpuRenderer = false;
+	//Keep the GPU renderer but check it against the CPU one every 100 frames
+	bool compareCpuRenderer = false;
+	//Trace the CPU renderer's primary rays as SSE packets where available
+	bool cpuPackets = true;
+	//Load models from a memory mapped cache written on first import
+	bool useSceneCache = true;
+	//Only render when the camera, light, cubes or model change, benchmarks always render
+	bool skipIdleFrames = true;
+	//GPU milliseconds a dispatch may take, above it the resolution drops while the
+	//scene changes and is refined over the next frames. 0 always renders full resolution
+	float frameBudget = 0;
+	//Bin cubes and triangles into screen tiles so primary rays only test their tile's lists
+	bool useTiles = false;
+	//Trace a shadow ray from every lit hit towards the light in a second dispatch
+	bool shadows = true;
+	//Reflections followed from each hit, above 0 rendering moves to the wavefront stages
+	int reflectionDepth = 0;
+	//Time compute.csh with each candidate work group size on the first frame and
+	//keep the fastest, remembered per GPU and driver in WORK_GROUP_CACHE
+	bool tuneWorkGroups = true;
+	//Save linked shader programs and load them on later starts instead of compiling
+	bool useShaderCache = true;
+};
+
+//What has changed since the framebuffer texture was last rendered
+struct DirtyState {
+	bool camera = true;
+	bool light = true;
+	bool cubes = true;
+	bool model = true;
+};
+
+struct HeadlessContext {
+#ifdef HEADLESS_EGL
+	EGLDisplay display = EGL_NO_DISPLAY;
+	EGLContext context = EGL_NO_CONTEXT;
+#endif
+};
+
+//Locations of the compute shader's uniforms, looked up again whenever the program is rebuilt
+struct ComputeUniforms {
+	GLint eye;
+	GLint ray00;
+	GLint ray10;
+	GLint ray01;
+	GLint ray11;
+	GLint lightPos;
+	GLint numCubes;
+	GLint numTriangles;
+	GLint useBVH;
+	GLint useVisibleCubes;
+	GLint pixelStep;
+	GLint pixelOffset;
+	GLint fillBlock;
+	GLint useTiles;
+	GLint tilesX;
+	GLint shadows;
+	GLint shadowPass;
+	GLint totalCubes;
+};
+
+//Coarsest adaptive resolution, one traced pixel per MAX_PIXEL_STEP square
+const int MAX_PIXEL_STEP = 8;
+//Screen tile the cubes and triangles are binned into, must match raycast.csh
+const int TILE_WIDTH = 16;
+const int TILE_HEIGHT = 8;
+//Work group sizes tried for compute.csh, the first is the one it is written for
+const glm::ivec2 WORK_GROUP_CANDIDATES[] = {
+	glm::ivec2(16, 8), glm::ivec2(8, 8), glm::ivec2(16, 16), glm::ivec2(32, 4),
+	glm::ivec2(32, 8), glm::ivec2(64, 1), glm::ivec2(8, 4)
 };
+//Dispatches timed per candidate after a warm up
+const int WORK_GROUP_TUNING_RUNS = 5;
+const std::string WORK_GROUP_CACHE = "workgroups.cache";
 
 bool KEYS[1024];
 float AVG_DT = 0;
 bool CUBE_TESTING = false;
 bool MODEL_TESTING = false;
 std::ofstream OUTPUT_FILE;
+std::ofstream CULLING_FILE;
 std::vector<Texture> texturesLoaded;
 
 cube* generateCubeData(int numCubes)
@@ -120,16 +224,247 @@ GLuint quadFullScreenVAO()
 	return vao;
 }
 
-int nextPowerOfTwo(int x)
+/**
+* Creates an OpenGL 4.3 core context with no surface at all, rendering only
+* ever goes to the framebuffer texture. Prefers Mesa's surfaceless platform so
+* no display server is needed, llvmpipe is fine for this.
+*/
+bool createHeadlessContext(HeadlessContext *headless)
+{
+#ifdef HEADLESS_EGL
+	EGLDisplay display = EGL_NO_DISPLAY;
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (getPlatformDisplay)
+	{
+		display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+	}
+	if (display == EGL_NO_DISPLAY)
+	{
+		display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	}
+
+	EGLint major, minor;
+	if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor))
+	{
+		std::cout << "Failed to initialize EGL" << std::endl;
+		return false;
+	}
+
+	if (!eglBindAPI(EGL_OPENGL_API))
+	{
+		std::cout << "EGL does not support desktop OpenGL" << std::endl;
+		eglTerminate(display);
+		return false;
+	}
+
+	EGLint configAttribs[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+	EGLConfig eglConfig;
+	EGLint numConfigs = 0;
+	eglChooseConfig(display, configAttribs, &eglConfig, 1, &numConfigs);
+
+	EGLint contextAttribs[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 4,
+		EGL_CONTEXT_MINOR_VERSION, 3,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+		EGL_NONE
+	};
+	EGLContext context = eglCreateContext(display, numConfigs > 0 ? eglConfig : (EGLConfig)0, EGL_NO_CONTEXT, contextAttribs);
+	if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+	{
+		std::cout << "Failed to create a surfaceless EGL context" << std::endl;
+		eglTerminate(display);
+		return false;
+	}
+
+	headless->display = display;
+	headless->context = context;
+	return true;
+#else
+	return false;
+#endif
+}
+
+void destroyHeadlessContext(HeadlessContext *headless)
+{
+#ifdef HEADLESS_EGL
+	if (headless->display != EGL_NO_DISPLAY)
+	{
+		eglMakeCurrent(headless->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		eglDestroyContext(headless->display, headless->context);
+		eglTerminate(headless->display);
+	}
+#endif
+}
+
+/**
+* Seconds since the first call. Used instead of glfwGetTime as headless runs
+* don't initialise GLFW.
+*/
+double getTime()
+{
+	static auto start = std::chrono::steady_clock::now();
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+std::string getLocalSizeDefines(glm::ivec2 localSize)
+{
+	return "#define LOCAL_SIZE_X " + std::to_string(localSize.x) + "\n#define LOCAL_SIZE_Y " + std::to_string(localSize.y) + "\n";
+}
+
+/**
+* Identifies the GPU and driver a tuned work group size was measured on. A
+* driver update can change which size is fastest, so it starts a new entry.
+*/
+std::string getDeviceKey()
+{
+	std::string key = Shader::getDriverString();
+
+	//The key is everything before the last '=' of a cache line
+	std::replace(key.begin(), key.end(), '=', ':');
+	std::replace(key.begin(), key.end(), '\n', ' ');
+	return key;
+}
+
+bool readCachedWorkGroupSize(std::string device, glm::ivec2 *localSize)
+{
+	std::ifstream cacheFile(WORK_GROUP_CACHE);
+	std::string line;
+	while (std::getline(cacheFile, line))
+	{
+		std::size_t found = line.rfind("=");
+		if (found == std::string::npos || line.substr(0, found) != device)
+		{
+			continue;
+		}
+
+		int x = 0, y = 0;
+		if (sscanf(line.c_str() + found + 1, "%dx%d", &x, &y) == 2 && x > 0 && y > 0)
+		{
+			*localSize = glm::ivec2(x, y);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void writeCachedWorkGroupSize(std::string device, glm::ivec2 localSize)
 {
-	x--;
-	x |= x >> 1; // handle 2 bit numbers
-	x |= x >> 2; // handle 4 bit numbers
-	x |= x >> 4; // handle 8 bit numbers
-	x |= x >> 8; // handle 16 bit numbers
-	x |= x >> 16; // handle 32 bit numbers
-	x++;
-	return x;
+	//Keep the sizes tuned for other devices
+	std::vector<std::string> lines;
+	std::ifstream cacheFile(WORK_GROUP_CACHE);
+	std::string line;
+	while (std::getline(cacheFile, line))
+	{
+		std::size_t found = line.rfind("=");
+		if (found != std::string::npos && line.substr(0, found) != device)
+		{
+			lines.push_back(line);
+		}
+	}
+	cacheFile.close();
+	lines.push_back(device + "=" + std::to_string(localSize.x) + "x" + std::to_string(localSize.y));
+
+	std::ofstream outFile(WORK_GROUP_CACHE);
+	for (const std::string &cached : lines)
+	{
+		outFile << cached << std::endl;
+	}
+}
+
+/**
+* Builds compute.csh with each of WORK_GROUP_CANDIDATES, copies the uniforms
+* set on program into it and times it tracing pixelsX by pixelsY pixels with
+* whatever buffers and images are bound. Returns the fastest size.
+*/
+glm::ivec2 tuneWorkGroupSize(GLuint program, int pixelsX, int pixelsY)
+{
+	int numCandidates = sizeof(WORK_GROUP_CANDIDATES) / sizeof(WORK_GROUP_CANDIDATES[0]);
+	glm::ivec2 best = WORK_GROUP_CANDIDATES[0];
+	GLuint64 bestTime = 0;
+
+	GLint maxInvocations = 0;
+	glGetIntegerv(GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS, &maxInvocations);
+
+	GLuint query;
+	glGenQueries(1, &query);
+	for (int i = 0; i < numCandidates; i++)
+	{
+		glm::ivec2 localSize = WORK_GROUP_CANDIDATES[i];
+		if (localSize.x * localSize.y > maxInvocations)
+		{
+			continue;
+		}
+
+		Shader candidate;
+		candidate.createShader("compute.csh", GL_COMPUTE_SHADER, getLocalSizeDefines(localSize));
+		candidate.createProgram();
+		GLint linked = GL_FALSE;
+		glGetProgramiv(candidate.getShaderProgram(), GL_LINK_STATUS, &linked);
+		if (linked != GL_TRUE)
+		{
+			glDeleteProgram(candidate.getShaderProgram());
+			continue;
+		}
+		candidate.copyUniforms(program);
+		glUseProgram(candidate.getShaderProgram());
+
+		int groupsX = (pixelsX + localSize.x - 1) / localSize.x;
+		int groupsY = (pixelsY + localSize.y - 1) / localSize.y;
+
+		//The first dispatch pays for any lazy compilation in the driver
+		glDispatchCompute(groupsX, groupsY, 1);
+		glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
+		glBeginQuery(GL_TIME_ELAPSED, query);
+		for (int run = 0; run < WORK_GROUP_TUNING_RUNS; run++)
+		{
+			glDispatchCompute(groupsX, groupsY, 1);
+			glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+		}
+		glEndQuery(GL_TIME_ELAPSED);
+
+		GLuint64 elapsed = 0;
+		glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+		std::cout << "Work group " << localSize.x << "x" << localSize.y << ": "
+			<< elapsed / 1e6 / WORK_GROUP_TUNING_RUNS << "ms" << std::endl;
+
+		if (bestTime == 0 || elapsed < bestTime)
+		{
+			bestTime = elapsed;
+			best = localSize;
+		}
+
+		glDeleteProgram(candidate.getShaderProgram());
+	}
+	glDeleteQueries(1, &query);
+
+	glUseProgram(program);
+	return best;
+}
+
+ComputeUniforms getComputeUniforms(GLuint program)
+{
+	ComputeUniforms uniforms;
+	uniforms.eye = glGetUniformLocation(program, "eye");
+	uniforms.ray00 = glGetUniformLocation(program, "ray00");
+	uniforms.ray10 = glGetUniformLocation(program, "ray10");
+	uniforms.ray01 = glGetUniformLocation(program, "ray01");
+	uniforms.ray11 = glGetUniformLocation(program, "ray11");
+	uniforms.lightPos = glGetUniformLocation(program, "lightPos");
+	uniforms.numCubes = glGetUniformLocation(program, "NUM_CUBES");
+	uniforms.numTriangles = glGetUniformLocation(program, "NUM_TRIANGLES");
+	uniforms.useBVH = glGetUniformLocation(program, "USE_BVH");
+	uniforms.useVisibleCubes = glGetUniformLocation(program, "USE_VISIBLE_CUBES");
+	uniforms.pixelStep = glGetUniformLocation(program, "PIXEL_STEP");
+	uniforms.pixelOffset = glGetUniformLocation(program, "PIXEL_OFFSET");
+	uniforms.fillBlock = glGetUniformLocation(program, "FILL_BLOCK");
+	uniforms.useTiles = glGetUniformLocation(program, "USE_TILES");
+	uniforms.tilesX = glGetUniformLocation(program, "TILES_X");
+	uniforms.shadows = glGetUniformLocation(program, "SHADOWS");
+	uniforms.shadowPass = glGetUniformLocation(program, "SHADOW_PASS");
+	uniforms.totalCubes = glGetUniformLocation(program, "TOTAL_CUBES");
+	return uniforms;
 }
 
 glm::vec4 calculateEyeRay(glm::vec4 eyeRay, glm::vec3 cameraPos, glm::mat4 inverseVP)
@@ -162,7 +497,7 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
 	}
 }
 
-glm::mat4 handleControls(glm::vec3 *pos, float *currentAngle, glm::mat4 projection, glm::mat4 vp, float dt)
+glm::mat4 handleControls(glm::vec3 *pos, float *currentAngle, glm::mat4 projection, glm::mat4 vp, float dt, bool *changed)
 {
 
 	const float SPEED = 10;
@@ -243,6 +578,7 @@ glm::mat4 handleControls(glm::vec3 *pos, float *currentAngle, glm::mat4 projecti
 		pos->y -= SPEED*dt;
 	}
 
+	*changed = viewChanged;
 	if (viewChanged)
 	{
 		glm::mat4 rotation = glm::rotate(glm::mat4(1.0), -*currentAngle, glm::vec3(0, 1, 0));
@@ -276,16 +612,255 @@ glm::vec3 getCubeCentre(cube c)
 	return result;
 }
 
+/**
+* Creates a shader storage buffer holding a copy of data that never changes.
+*/
+GLuint createStaticBuffer(const void *data, GLsizeiptr size)
+{
+	GLuint buffer;
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, size, size > 0 ? data : nullptr, GL_STATIC_COPY);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	return buffer;
+}
+
+/**
+* Uploads the whole cube set once into immutable storage. The spatial indices
+* only hand out indices into this buffer, so it never changes while the set
+* of cubes stays the same.
+*/
+GLuint createCubeBuffer(cube *cubes, int numCubes)
+{
+	//Zero sized storage isn't allowed, generateCubeData always returns at least one cube
+	GLsizeiptr size = sizeof(cube)*(numCubes > 0 ? numCubes : 1);
+
+	GLuint buffer;
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+	if (GLEW_ARB_buffer_storage)
+	{
+		glBufferStorage(GL_SHADER_STORAGE_BUFFER, size, &cubes[0], 0);
+	}
+	else
+	{
+		glBufferData(GL_SHADER_STORAGE_BUFFER, size, &cubes[0], GL_STATIC_DRAW);
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	return buffer;
+}
+
+void buildOctree(Octree<GLuint> *octree, cube *cubes, int numCubes)
+{
+	octree->clear();
+	for (int i = 0; i < numCubes; i++)
+	{
+		octree->insert(i, glm::vec3(cubes[i].cubeMin), glm::vec3(cubes[i].cubeMax));
+	}
+	octree->build();
+}
+
+/**
+* Searches the quadtree with the XY rectangle spanned by the bottom left and
+* top right frustum corner rays, appending the matching cubes to results.
+*/
+void searchQuadtree(Quadtree<GLuint> *quad, glm::vec3 camera, glm::mat4 inverseVP, std::vector<GLuint> *results)
+{
+	glm::vec4 eyeRay = calculateEyeRay(glm::vec4(-1, -1, 0, 1), camera, inverseVP);
+	glm::vec2 topLeftCorner = glm::vec2(eyeRay.x, eyeRay.y);
+
+	eyeRay = calculateEyeRay(glm::vec4(1, 1, 0, 1), camera, inverseVP);
+	glm::vec2 botRightCorner = glm::vec2(eyeRay.x, eyeRay.y);
+
+	topLeftCorner = topLeftCorner*1000.f;
+	botRightCorner = botRightCorner*1000.f;
+
+	glm::vec2 diff = glm::abs(botRightCorner - topLeftCorner);
+	glm::vec2 mid = glm::min(topLeftCorner, botRightCorner) + (diff*0.5f);
+	quad->search(glm::vec2(mid.x, mid.y), glm::vec2(diff.x, diff.y), results);
+}
+
+/**
+* Times the quadtree and octree queries for the current view and compares the
+* cubes they return against a brute force frustum test of every cube.
+*/
+void runCullingBenchmark(Quadtree<GLuint> *quad, Octree<GLuint> *octree, cube *cubes, int numCubes, glm::vec3 camera, glm::mat4 vp)
+{
+	const int ITERATIONS = 100;
+	Frustum frustum(vp);
+	glm::mat4 inverseVP = glm::inverse(vp);
+
+	int exactVisible = 0;
+	for (int i = 0; i < numCubes; i++)
+	{
+		if (frustum.intersects(glm::vec3(cubes[i].cubeMin), glm::vec3(cubes[i].cubeMax)))
+		{
+			exactVisible++;
+		}
+	}
+
+	std::vector<GLuint> quadResult;
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < ITERATIONS; i++)
+	{
+		quadResult.clear();
+		searchQuadtree(quad, camera, inverseVP, &quadResult);
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+	float quadMs = std::chrono::duration<float, std::milli>(end - start).count() / ITERATIONS;
+
+	std::vector<GLuint> octreeResult;
+	start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < ITERATIONS; i++)
+	{
+		octreeResult.clear();
+		octree->search(frustum, &octreeResult);
+	}
+	end = std::chrono::high_resolution_clock::now();
+	float octreeMs = std::chrono::duration<float, std::milli>(end - start).count() / ITERATIONS;
+
+	//Visible cubes the quadtree culled and invisible cubes it kept
+	int quadCorrect = 0;
+	for (int i = 0; i < quadResult.size(); i++)
+	{
+		cube c = cubes[quadResult[i]];
+		if (frustum.intersects(glm::vec3(c.cubeMin), glm::vec3(c.cubeMax)))
+		{
+			quadCorrect++;
+		}
+	}
+	int quadMissed = exactVisible - quadCorrect;
+	int quadExtra = quadResult.size() - quadCorrect;
+
+	std::cout << "Culling " << numCubes << " cubes, " << exactVisible << " visible: quadtree " << quadMs << "ms ("
+		<< quadMissed << " missed, " << quadExtra << " extra), octree " << octreeMs << "ms (" << octreeResult.size() << " returned)" << std::endl;
+	CULLING_FILE << numCubes << ", " << exactVisible << ", " << quadMs << ", " << quadResult.size() << ", " << quadMissed << ", "
+		<< quadExtra << ", " << octreeMs << ", " << octreeResult.size() << "\n";
+}
+
+/**
+* Appends the min, average and 99th percentile of each stage to the current
+* output.csv row as "name, min, avg, p99" groups.
+*/
+void writeStageStats(std::vector<StageStats*> stages)
+{
+	for (int i = 0; i < stages.size(); i++)
+	{
+		if (stages[i]->getCount() == 0)
+		{
+			continue;
+		}
+
+		OUTPUT_FILE << ", " << stages[i]->getName() << ", " << stages[i]->getMin() << ", "
+			<< stages[i]->getAverage() << ", " << stages[i]->getPercentile(0.99f);
+	}
+}
+
+void printStageStats(std::vector<StageStats*> stages)
+{
+	for (int i = 0; i < stages.size(); i++)
+	{
+		if (stages[i]->getCount() == 0)
+		{
+			continue;
+		}
+
+		std::cout << "  " << stages[i]->getName() << ": min " << stages[i]->getMin() << "ms, avg "
+			<< stages[i]->getAverage() << "ms, p99 " << stages[i]->getPercentile(0.99f) << "ms" << std::endl;
+	}
+}
+
+/**
+* Reads back level 0 of a texture as RGBA floats.
+*/
+std::vector<float> readTexture(GLuint texture)
+{
+	GLint width, height;
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+
+	std::vector<float> texels(width * height * 4);
+	if (texels.size() > 0)
+	{
+		glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, &texels[0]);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	return texels;
+}
+
+/**
+* Reads back every mip level of a texture array for the CPU renderer.
+*/
+std::vector<TextureLevel> readTextureLevels(GLuint texture)
+{
+	std::vector<TextureLevel> levels;
+	GLint numLevels = 0;
+	glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+	glGetTexParameteriv(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_IMMUTABLE_LEVELS, &numLevels);
+
+	for (int i = 0; i < numLevels; i++)
+	{
+		TextureLevel level;
+		glGetTexLevelParameteriv(GL_TEXTURE_2D_ARRAY, i, GL_TEXTURE_WIDTH, &level.width);
+		glGetTexLevelParameteriv(GL_TEXTURE_2D_ARRAY, i, GL_TEXTURE_HEIGHT, &level.height);
+		glGetTexLevelParameteriv(GL_TEXTURE_2D_ARRAY, i, GL_TEXTURE_DEPTH, &level.layers);
+		level.texels.resize(level.width * level.height * level.layers * 4);
+		glGetTexImage(GL_TEXTURE_2D_ARRAY, i, GL_RGBA, GL_FLOAT, &level.texels[0]);
+		levels.push_back(level);
+	}
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+	return levels;
+}
+
+/**
+* Prints how far the CPU renderer's image is from the compute shader's.
+* The GPU is free to fuse multiplies and adds, so only differences above a
+* small tolerance count as mismatches.
+*/
+void compareFramebuffers(const std::vector<float> &cpu, const std::vector<float> &gpu)
+{
+	if (cpu.size() != gpu.size())
+	{
+		std::cout << "CPU renderer: framebuffer sizes differ" << std::endl;
+		return;
+	}
+
+	int mismatched = 0;
+	float maxDifference = 0;
+	for (int i = 0; i < cpu.size(); i += 4)
+	{
+		float difference = 0;
+		for (int c = 0; c < 4; c++)
+		{
+			difference = std::max(difference, std::abs(cpu[i + c] - gpu[i + c]));
+		}
+
+		maxDifference = std::max(maxDifference, difference);
+		if (difference > 1e-3f)
+		{
+			mismatched++;
+		}
+	}
+
+	std::cout << "CPU renderer: " << mismatched << " of " << cpu.size() / 4 << " pixels differ from the GPU, max difference "
+		<< maxDifference << std::endl;
+}
+
 std::string getConfigValue(std::string line, std::string config)
 {
-	std::size_t found = line.find(config);
+	std::size_t found = line.find("=");
 	if (found == std::string::npos)
 	{
 		return "";
 	}
 
-	found = line.find("=");
-	if (found == std::string::npos)
+	//Match the whole key so that one key can't be mistaken for another containing it
+	if (line.substr(0, found) != config)
 	{
 		return "";
 	}
@@ -293,7 +868,7 @@ std::string getConfigValue(std::string line, std::string config)
 	return line.substr(found + 1);
 }
 
-void loadConfig(GLuint *w, GLuint *h, std::string *modelPath, int *numCubes, bool *useQuadtree)
+void loadConfig(Config *config)
 {
 	std::ifstream configFile;
 	configFile.open("config.txt");
@@ -309,25 +884,25 @@ void loadConfig(GLuint *w, GLuint *h, std::string *modelPath, int *numCubes, boo
 		std::string value = getConfigValue(line, "width");
 		if (value != "") 
 		{
-			*w = stoi(value);
+			config->width = stoi(value);
 		}
 
 		value = getConfigValue(line, "height");
 		if (value != "")
 		{
-			*h = stoi(value);
+			config->height = stoi(value);
 		}
 
 		value = getConfigValue(line, "modelPath");
 		if (value != "")
 		{
-			*modelPath = value;
+			config->modelPath = value;
 		}
 
 		value = getConfigValue(line, "numCubes");
 		if (value != "")
 		{
-			*numCubes = stoi(value);
+			config->numCubes = stoi(value);
 		}
 
 		value = getConfigValue(line, "testing");
@@ -347,7 +922,101 @@ void loadConfig(GLuint *w, GLuint *h, std::string *modelPath, int *numCubes, boo
 		value = getConfigValue(line, "useQuadtree");
 		if (value == "true")
 		{
-			*useQuadtree = true;
+			config->useQuadtree = true;
+		}
+
+		value = getConfigValue(line, "useOctree");
+		if (value == "true")
+		{
+			config->useOctree = true;
+		}
+
+		value = getConfigValue(line, "benchmarkCulling");
+		if (value == "true")
+		{
+			config->benchmarkCulling = true;
+		}
+
+		value = getConfigValue(line, "useBVH");
+		if (value == "true")
+		{
+			config->useBVH = true;
+		}
+
+		value = getConfigValue(line, "headless");
+		if (value == "true")
+		{
+			config->headless = true;
+		}
+
+		value = getConfigValue(line, "headlessFrames");
+		if (value != "")
+		{
+			config->headlessFrames = stoi(value);
+		}
+
+		value = getConfigValue(line, "cpuRenderer");
+		if (value == "true")
+		{
+			config->useCpuRenderer = true;
+		}
+		else if (value == "compare")
+		{
+			config->compareCpuRenderer = true;
+		}
+
+		value = getConfigValue(line, "sceneCache");
+		if (value == "false")
+		{
+			config->useSceneCache = false;
+		}
+
+		value = getConfigValue(line, "cpuPackets");
+		if (value == "false")
+		{
+			config->cpuPackets = false;
+		}
+
+		value = getConfigValue(line, "skipIdleFrames");
+		if (value == "false")
+		{
+			config->skipIdleFrames = false;
+		}
+
+		value = getConfigValue(line, "frameBudget");
+		if (value != "")
+		{
+			config->frameBudget = stof(value);
+		}
+
+		value = getConfigValue(line, "tileBinning");
+		if (value == "true")
+		{
+			config->useTiles = true;
+		}
+
+		value = getConfigValue(line, "shadows");
+		if (value == "false")
+		{
+			config->shadows = false;
+		}
+
+		value = getConfigValue(line, "reflectionDepth");
+		if (value != "")
+		{
+			config->reflectionDepth = stoi(value);
+		}
+
+		value = getConfigValue(line, "tuneWorkGroups");
+		if (value == "false")
+		{
+			config->tuneWorkGroups = false;
+		}
+
+		value = getConfigValue(line, "shaderCache");
+		if (value == "false")
+		{
+			config->useShaderCache = false;
 		}
 	}
 
@@ -357,48 +1026,157 @@ void loadConfig(GLuint *w, GLuint *h, std::string *modelPath, int *numCubes, boo
 int main()
 {
 	//Config Values
-	GLuint WIDTH = 512, HEIGHT = 384;
-	std::string modelPath = "";
-	int NUM_CUBES = 0;
-	bool useQuadtree = false;
-
-	loadConfig(&WIDTH, &HEIGHT, &modelPath, &NUM_CUBES, &useQuadtree);
+	Config config;
+	loadConfig(&config);
+
+	GLuint WIDTH = config.width, HEIGHT = config.height;
+	std::string modelPath = config.modelPath;
+	int NUM_CUBES = config.numCubes;
+	bool useQuadtree = config.useQuadtree;
+	bool useOctree = config.useOctree;
+	bool benchmarkCulling = config.benchmarkCulling;
+	bool useBVH = config.useBVH;
+	bool useTiles = config.useTiles;
+	bool shadows = config.shadows;
+	int reflectionDepth = std::max(config.reflectionDepth, 0);
+	bool useSceneCache = config.useSceneCache;
+	bool headless = config.headless;
+	bool useCpuRenderer = config.useCpuRenderer;
+	bool compareCpuRenderer = config.compareCpuRenderer && !useCpuRenderer;
 
 	if (CUBE_TESTING || MODEL_TESTING)
 	{
 		OUTPUT_FILE.open("output.csv");
 	}
 
-	//Init GLFW
-	glfwInit();
-	//Set all the required options for GLFW
-	glfwDefaultWindowHints();
-	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-	glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
-	glfwWindowHint(GLFW_RESIZABLE, GL_FALSE);
+	//The culling benchmark needs both structures and a changing cube count
+	benchmarkCulling = benchmarkCulling && CUBE_TESTING;
+	if (benchmarkCulling)
+	{
+		CULLING_FILE.open("culling.csv");
+		CULLING_FILE << "cubes, visible, quadtree ms, quadtree returned, quadtree missed, quadtree extra, octree ms, octree returned\n";
+	}
 
-	//Create a GLFWwindow object that we can use for GLFW's functions
-	GLFWwindow* window = glfwCreateWindow(WIDTH, HEIGHT, "Raycaster", nullptr, nullptr);
-	glfwMakeContextCurrent(window);
+	GLFWwindow* window = nullptr;
+	HeadlessContext headlessContext;
+	bool usingGLFW = true;
 
-	//Set the required callback functions
-	glfwSetKeyCallback(window, key_callback);
+	if (headless && createHeadlessContext(&headlessContext))
+	{
+		usingGLFW = false;
+		std::cout << "Headless: surfaceless EGL context" << std::endl;
+	}
+	else
+	{
+		//Init GLFW
+		glfwInit();
+		//Set all the required options for GLFW
+		glfwDefaultWindowHints();
+		glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+		glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+		glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+		glfwWindowHint(GLFW_RESIZABLE, GL_FALSE);
+
+		//Create a GLFWwindow object that we can use for GLFW's functions
+		window = glfwCreateWindow(WIDTH, HEIGHT, "Raycaster", nullptr, nullptr);
+		if (window == nullptr)
+		{
+			std::cout << "Failed to create a window or context\n";
+			glfwTerminate();
+			return -1;
+		}
+		glfwMakeContextCurrent(window);
 
-	glfwShowWindow(window);
+		//Set the required callback functions
+		glfwSetKeyCallback(window, key_callback);
+
+		//Without EGL headless runs fall back to a window that is never shown
+		if (headless)
+		{
+			std::cout << "Headless: hidden window" << std::endl;
+		}
+		else
+		{
+			glfwShowWindow(window);
+		}
+	}
 
 	//Initialize GLEW
 	glewExperimental = true; // Needed for core profile
-	if (glewInit() != GLEW_OK)
+	GLenum glewResult = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+	//GLX builds of GLEW complain about the missing X display once the core
+	//entry points are already loaded, which is expected for an EGL context
+	if (!usingGLFW && glewResult == GLEW_ERROR_NO_GLX_DISPLAY)
+	{
+		glewResult = GLEW_OK;
+	}
+#endif
+	if (glewResult != GLEW_OK)
 	{
 		std::cout << "Failed to initialize GLEW\n";
 		return -1;
 	}
 
-	Model model(modelPath);
-	std::vector<Tri> modelTriangles = model.getModelTris();
+	ThreadPool pool;
+
+	//The model comes from its scene cache when that is up to date, otherwise it
+	//is imported with Assimp and the cache is written for the next start
+	Model model;
+	SceneCache sceneCache;
+	BVH bvh;
+	std::vector<glm::vec3> importedPositions;
+	std::vector<VertexAttributes> importedAttributes;
+	std::vector<GLuint> importedIndices;
+	std::vector<BVHNode> importedNodes;
+
+	auto loadStart = std::chrono::high_resolution_clock::now();
+	bool cached = useSceneCache && sceneCache.open(modelPath);
+	if (cached)
+	{
+		model.loadTextures(modelPath, sceneCache.getTextures(), &pool);
+	}
+	else
+	{
+		model.loadModel(modelPath, &pool);
+		model.moveGeometry(&importedPositions, &importedAttributes, &importedIndices);
+
+		//The BVH reorders importedIndices so it must be built before the upload.
+		//A cache always gets one so it suits either intersection mode
+		if (importedIndices.size() > 0 && (useBVH || useSceneCache))
+		{
+			bvh.build(importedPositions, &importedIndices, &pool);
+			importedNodes = bvh.getNodes();
+			std::cout << "BVH built in " << bvh.getBuildTime() << "ms on " << pool.getThreadCount() << " threads: "
+				<< bvh.getNodeCount() << " nodes, depth " << bvh.getDepth() << ", SAH cost " << bvh.getSAHCost() << std::endl;
+		}
+
+		if (useSceneCache && SceneCache::write(modelPath, importedPositions, importedAttributes, importedIndices, importedNodes, model.getMaterials(), model.getTextures()))
+		{
+			std::cout << "Scene cache written for " << modelPath << std::endl;
+		}
+	}
+
+	//Views into either the mapped cache or the imported arrays
+	ArrayView<glm::vec3> vertexPositions = cached ? sceneCache.getVertexPositions() : ArrayView<glm::vec3>(importedPositions);
+	ArrayView<VertexAttributes> vertexAttributes = cached ? sceneCache.getVertexAttributes() : ArrayView<VertexAttributes>(importedAttributes);
+	ArrayView<GLuint> modelIndices = cached ? sceneCache.getIndices() : ArrayView<GLuint>(importedIndices);
+	ArrayView<BVHNode> bvhNodes = cached ? sceneCache.getBVHNodes() : ArrayView<BVHNode>(importedNodes);
+	ArrayView<Material> modelMaterials = cached ? sceneCache.getMaterials() : model.getMaterials();
+	int numTriangles = modelIndices.size() / 3;
+	if (bvhNodes.empty())
+	{
+		useBVH = false;
+	}
+
+	auto loadEnd = std::chrono::high_resolution_clock::now();
+	if (numTriangles > 0)
+	{
+		std::cout << "Model " << (cached ? "mapped from scene cache" : "imported") << " in "
+			<< std::chrono::duration<float, std::milli>(loadEnd - loadStart).count() << "ms" << std::endl;
+	}
 
 	//Define the viewport dimensions
 	glViewport(0, 0, WIDTH, HEIGHT);
@@ -406,9 +1184,21 @@ int main()
 	GLuint tex = createFramebufferTexture(WIDTH, HEIGHT);
 	GLuint vao = quadFullScreenVAO();
 
+	Shader::setBinaryCache(config.useShaderCache);
+
+	//A work group size tuned on an earlier run is used straight away, otherwise
+	//the first GPU frame tunes one. The wavefront stages don't run compute.csh
+	std::string device = getDeviceKey();
+	glm::ivec2 localSize = WORK_GROUP_CANDIDATES[0];
+	bool tuneWorkGroups = false;
+	if (config.tuneWorkGroups && !readCachedWorkGroupSize(device, &localSize))
+	{
+		tuneWorkGroups = !useCpuRenderer && reflectionDepth == 0;
+	}
+
 	//Setup compute program
 	Shader computeProgram;
-	computeProgram.createShader("compute.csh", GL_COMPUTE_SHADER);
+	computeProgram.createShader("compute.csh", GL_COMPUTE_SHADER, getLocalSizeDefines(localSize));
 	computeProgram.createProgram();
 
 	glUseProgram(computeProgram.getShaderProgram());
@@ -418,14 +1208,7 @@ int main()
 	GLint workGroupSizeY = workGroupSize[1];
 
 	//Setup the uniforms needed for the compute shader
-	GLuint eyeUniform = glGetUniformLocation(computeProgram.getShaderProgram(), "eye");
-	GLuint ray00Uniform = glGetUniformLocation(computeProgram.getShaderProgram(), "ray00");
-	GLuint ray10Uniform = glGetUniformLocation(computeProgram.getShaderProgram(), "ray10");
-	GLuint ray01Uniform = glGetUniformLocation(computeProgram.getShaderProgram(), "ray01");
-	GLuint ray11Uniform = glGetUniformLocation(computeProgram.getShaderProgram(), "ray11");
-	GLuint lightPosUniform = glGetUniformLocation(computeProgram.getShaderProgram(), "lightPos");
-	GLuint numCubesUniform = glGetUniformLocation(computeProgram.getShaderProgram(), "NUM_CUBES");
-	GLuint numTriUniform = glGetUniformLocation(computeProgram.getShaderProgram(), "NUM_TRIANGLES");
+	ComputeUniforms computeUniforms = getComputeUniforms(computeProgram.getShaderProgram());
 
 	cube *cubes = new cube[NUM_CUBES + 1];
 	cubes = generateCubeData(NUM_CUBES);
@@ -437,64 +1220,137 @@ int main()
 		cubes = generateCubeData(NUM_CUBES);
 	}
 
-	Quadtree<cube> quad(glm::vec2(50, 50), glm::vec2(100, 100));
-	if (useQuadtree)
+	Quadtree<GLuint> quad(glm::vec2(50, 50), glm::vec2(100, 100));
+	if (useQuadtree || benchmarkCulling)
 	{
 		for (int i = 0; i < NUM_CUBES; i++)
 		{
 			glm::vec3 centre = getCubeCentre(cubes[i]);
-			quad.insert(cubes[i], glm::vec2(centre.x, centre.y));
+			quad.insert(i, glm::vec2(centre.x, centre.y));
 		}
 	}
 
 
-	//Setup Cube Shader Buffer
-	GLuint cubeShaderBuffer;
-	glGenBuffers(1, &cubeShaderBuffer);
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, cubeShaderBuffer);
-	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(cube)*NUM_CUBES, &cubes[0], GL_STATIC_COPY);
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	Octree<GLuint> octree;
+	if (useOctree || benchmarkCulling)
+	{
+		buildOctree(&octree, cubes, NUM_CUBES);
+	}
 
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, cubeShaderBuffer);
-	GLvoid* p = glMapBuffer(GL_SHADER_STORAGE_BUFFER, GL_WRITE_ONLY);
-	memcpy(p, &cubes[0], sizeof(cube)*NUM_CUBES);
-	glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+	//Setup Cube Shader Buffer
+	GLuint cubeShaderBuffer = createCubeBuffer(cubes, NUM_CUBES);
 
 	GLuint blockIndex;
 	blockIndex = glGetProgramResourceIndex(computeProgram.getShaderProgram(), GL_SHADER_STORAGE_BLOCK, "cubes");
 	glShaderStorageBlockBinding(computeProgram.getShaderProgram(), blockIndex, 2);
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, cubeShaderBuffer);
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, cubeShaderBuffer);
 
-	//Setup Triangle Shader Buffer
-	GLuint triShaderBuffer;
-	glGenBuffers(1, &triShaderBuffer);
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, triShaderBuffer);
-	if (modelTriangles.size() != 0)
-	{
-		glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(Tri)*modelTriangles.size(), &modelTriangles[0], GL_STATIC_COPY);
-	}
-	else
+	//Setup Visible Cube Index Buffer, written every frame when culling
+	bool cullCubes = useOctree || useQuadtree;
+	RingBuffer *visibleCubeBuffer = nullptr;
+	std::vector<GLuint> visibleCubes;
+	if (cullCubes)
 	{
-		glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(Tri)*modelTriangles.size(), nullptr, GL_STATIC_COPY);
+		visibleCubeBuffer = new RingBuffer(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint)*NUM_CUBES);
+		visibleCubes.reserve(NUM_CUBES);
 	}
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, triShaderBuffer);
-	p = glMapBuffer(GL_SHADER_STORAGE_BUFFER, GL_WRITE_ONLY);
-	if (modelTriangles.size() != 0)
-	{
-		memcpy(p, &modelTriangles[0], sizeof(Tri)*modelTriangles.size());
-	}
-	glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+	blockIndex = glGetProgramResourceIndex(computeProgram.getShaderProgram(), GL_SHADER_STORAGE_BLOCK, "visibleCubes");
+	glShaderStorageBlockBinding(computeProgram.getShaderProgram(), blockIndex, 5);
+
+	//Setup Model Shader Buffers. Triangles are indices into shared vertices, the
+	//hit test only reads the indices and positions, the normals and texture
+	//co-ords sit in their own buffer for the closest hit
+	GLuint triShaderBuffer = createStaticBuffer(modelIndices.data(), modelIndices.sizeBytes());
+	GLuint vertexShaderBuffer = createStaticBuffer(vertexPositions.data(), vertexPositions.sizeBytes());
+	GLuint vertexAttribShaderBuffer = createStaticBuffer(vertexAttributes.data(), vertexAttributes.sizeBytes());
 
 	blockIndex = glGetProgramResourceIndex(computeProgram.getShaderProgram(), GL_SHADER_STORAGE_BLOCK, "triangles");
 	glShaderStorageBlockBinding(computeProgram.getShaderProgram(), blockIndex, 3);
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, triShaderBuffer);
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, triShaderBuffer);
+
+	blockIndex = glGetProgramResourceIndex(computeProgram.getShaderProgram(), GL_SHADER_STORAGE_BLOCK, "vertexAttributes");
+	glShaderStorageBlockBinding(computeProgram.getShaderProgram(), blockIndex, 6);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, vertexAttribShaderBuffer);
+
+	blockIndex = glGetProgramResourceIndex(computeProgram.getShaderProgram(), GL_SHADER_STORAGE_BLOCK, "vertices");
+	glShaderStorageBlockBinding(computeProgram.getShaderProgram(), blockIndex, 7);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, vertexShaderBuffer);
+
+	//Each triangle picks its material through its first vertex, the material picks the texture
+	//array and layer. It is uploaded again with those filled in once the textures arrive
+	GLuint materialShaderBuffer = createStaticBuffer(modelMaterials.data(), modelMaterials.sizeBytes());
+
+	blockIndex = glGetProgramResourceIndex(computeProgram.getShaderProgram(), GL_SHADER_STORAGE_BLOCK, "materials");
+	glShaderStorageBlockBinding(computeProgram.getShaderProgram(), blockIndex, 8);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, materialShaderBuffer);
+
+	//Setup BVH Shader Buffer
+	GLuint bvhShaderBuffer = createStaticBuffer(bvhNodes.data(), bvhNodes.sizeBytes());
+
+	blockIndex = glGetProgramResourceIndex(computeProgram.getShaderProgram(), GL_SHADER_STORAGE_BLOCK, "bvh");
+	glShaderStorageBlockBinding(computeProgram.getShaderProgram(), blockIndex, 4);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, bvhShaderBuffer);
+
+	//Setup Tile List Buffers, rebinned on the CPU whenever the view or scene changes.
+	//Triangles fall back to the BVH when it is on
+	TileBinner cubeBinner(&pool);
+	TileBinner triBinner(&pool);
+	cubeBinner.setScreen(WIDTH, HEIGHT, TILE_WIDTH, TILE_HEIGHT);
+	triBinner.setScreen(WIDTH, HEIGHT, TILE_WIDTH, TILE_HEIGHT);
+
+	blockIndex = glGetProgramResourceIndex(computeProgram.getShaderProgram(), GL_SHADER_STORAGE_BLOCK, "cubeTileOffsets");
+	glShaderStorageBlockBinding(computeProgram.getShaderProgram(), blockIndex, 9);
+	blockIndex = glGetProgramResourceIndex(computeProgram.getShaderProgram(), GL_SHADER_STORAGE_BLOCK, "cubeTileIndices");
+	glShaderStorageBlockBinding(computeProgram.getShaderProgram(), blockIndex, 10);
+	blockIndex = glGetProgramResourceIndex(computeProgram.getShaderProgram(), GL_SHADER_STORAGE_BLOCK, "triTileOffsets");
+	glShaderStorageBlockBinding(computeProgram.getShaderProgram(), blockIndex, 11);
+	blockIndex = glGetProgramResourceIndex(computeProgram.getShaderProgram(), GL_SHADER_STORAGE_BLOCK, "triTileIndices");
+	glShaderStorageBlockBinding(computeProgram.getShaderProgram(), blockIndex, 12);
+
+	//Setup Shadow Ray Buffer, two vec4s a pixel written by the primary pass for the shadow pass
+	GLuint shadowRayBuffer = createStaticBuffer(nullptr, shadows && reflectionDepth == 0 ? sizeof(glm::vec4) * 2 * WIDTH * HEIGHT : 0);
+
+	blockIndex = glGetProgramResourceIndex(computeProgram.getShaderProgram(), GL_SHADER_STORAGE_BLOCK, "shadowRays");
+	glShaderStorageBlockBinding(computeProgram.getShaderProgram(), blockIndex, 13);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 13, shadowRayBuffer);
 
 	glUseProgram(0);
 
+	//Reflections are traced by separate stages sharing compute.csh's buffers
+	Wavefront *wavefront = nullptr;
+	if (reflectionDepth > 0)
+	{
+		wavefront = new Wavefront(WIDTH, HEIGHT, computeProgram.getShaderProgram());
+	}
+
+	//Setup CPU renderer, it reads the same cubes, triangles and BVH as the shader
+	//Set once the model's textures have streamed in rather than looked up every frame
+	std::vector<GLuint> modelTextures;
+	std::vector<Material> texturedMaterials;
+	std::vector<std::vector<TextureLevel>> modelTextureLevels;
+
+	//Benchmarks should not time frames rendered before the texture arrives
+	if (headless || MODEL_TESTING)
+	{
+		model.finishTextures();
+	}
+
+	CpuRaycaster cpuRaycaster(&pool);
+	std::vector<float> cpuFramebuffer;
+	std::vector<float> gpuFramebuffer;
+	if (useCpuRenderer || compareCpuRenderer)
+	{
+		cpuFramebuffer.resize(WIDTH * HEIGHT * 4);
+		cpuRaycaster.setTriangles(vertexPositions, vertexAttributes, modelIndices, useBVH ? bvhNodes : ArrayView<BVHNode>());
+		cpuRaycaster.setMaterials(modelMaterials);
+		cpuRaycaster.setPacketTracing(config.cpuPackets);
+		cpuRaycaster.setShadows(shadows);
+		cpuRaycaster.setReflectionDepth(reflectionDepth);
+
+		std::cout << "CPU renderer: " << pool.getThreadCount() << " threads" << (compareCpuRenderer ? ", comparing against the GPU" : "") << std::endl;
+	}
+
 	//Setup drawing program
 	Shader quadProgram;
 	quadProgram.createShader("quad.vs", GL_VERTEX_SHADER);
@@ -520,8 +1376,25 @@ int main()
 	glm::mat4 view = r * t;
 	glm::mat4 VP = projection * view;
 
-	GLfloat lastFrame = glfwGetTime();
-	GLfloat dt = glfwGetTime();
+	GLfloat lastFrame = getTime();
+	GLfloat dt = getTime();
+
+	//Everything starts dirty so the first frame renders. Benchmarks render every
+	//frame, otherwise an unchanged scene re-presents the last image
+	DirtyState dirty;
+	bool alwaysRender = !config.skipIdleFrames || headless || CUBE_TESTING || MODEL_TESTING;
+	bool idle = false;
+	glm::vec3 lightPos = glm::vec3(5, 5, 5);
+
+	//Adaptive resolution. A change renders one pixel per pixelStep square and fills
+	//the square, the following frames trace the rest of each square one pixel a
+	//frame until refinePass reaches pixelStep^2. adaptiveStep follows the GPU timer
+	float frameBudget = config.frameBudget;
+	int adaptiveStep = 1;
+	int pixelStep = 1;
+	int refinePass = 0;
+	//Full resolution cost of the latest shadow pass, counted against the budget with the dispatch
+	float shadowFullMs = 0;
 
 	float totalDT = 0;
 	int frameNum = 0;
@@ -544,17 +1417,51 @@ int main()
 		std::cout << "TESTING MODE: CUBE" << std::endl;
 	}
 
-	if (modelTriangles.size() > 0)
+	if (numTriangles > 0)
 	{
-		std::cout << "Model polygon count: " << modelTriangles.size() << std::endl;
+		std::cout << "Model polygon count: " << numTriangles << ", " << vertexPositions.size() << " vertices" << std::endl;
+
+		if (useBVH)
+		{
+			std::cout << "Triangle intersection: BVH (" << bvhNodes.size() << " nodes)" << std::endl;
+		}
+		else
+		{
+			std::cout << "Triangle intersection: Linear" << std::endl;
+		}
 	}
 
 	
 	//Window loop
-	while (!glfwWindowShouldClose(window))
+	//Per stage timings, written to output.csv every 100 frames
+	StageStats searchStats("search");
+	StageStats uploadStats("upload");
+	StageStats dispatchStats("dispatch");
+	StageStats blitStats("blit");
+	StageStats cpuStats("cpu");
+	StageStats binningStats("binning");
+	StageStats shadowStats("shadows");
+	std::vector<StageStats*> stages = { &searchStats, &uploadStats, &binningStats, &dispatchStats, &shadowStats, &blitStats, &cpuStats };
+	GpuTimer *dispatchTimer = new GpuTimer(&dispatchStats);
+	GpuTimer *shadowTimer = new GpuTimer(&shadowStats);
+	GpuTimer *blitTimer = new GpuTimer(&blitStats);
+
+	//Per frame timings for the headless report
+	std::vector<float> frameTimes;
+	int headlessFrames = CUBE_TESTING ? -1 : config.headlessFrames;
+	bool closeRequested = false;
+
+	while (!closeRequested && (window == nullptr || !glfwWindowShouldClose(window)))
 	{
+		//Nothing changed last frame, sleep until there is input rather than spin.
+		//The timeout keeps streaming textures coming in
+		if (idle && usingGLFW)
+		{
+			glfwWaitEventsTimeout(0.1);
+			lastFrame = getTime();
+		}
 
-		GLfloat currentFrame = glfwGetTime();
+		GLfloat currentFrame = getTime();
 		dt = currentFrame - lastFrame;
 		lastFrame = currentFrame;
 
@@ -566,6 +1473,15 @@ int main()
 			AVG_DT = totalDT / 100;
 			frameNum = 0;
 			totalDT = 0;
+
+			if (MODEL_TESTING)
+			{
+				float fps = 1 / AVG_DT;
+				std::cout << numTriangles << " triangles at " << fps << " fps" << std::endl;
+				OUTPUT_FILE << fps << ", " << numTriangles << ", " << (useBVH ? "bvh" : "linear");
+				writeStageStats(stages);
+				OUTPUT_FILE << "\n";
+			}
 			
 			if (CUBE_TESTING)
 			{
@@ -573,43 +1489,100 @@ int main()
 				delete[] cubes;
 				cubes = generateCubeData(NUM_CUBES);
 
-				glUseProgram(computeProgram.getShaderProgram());
-				glBindBuffer(GL_SHADER_STORAGE_BUFFER, cubeShaderBuffer);
-				glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(cube)*NUM_CUBES, &cubes[0], GL_STATIC_COPY);
-				glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
-
-				glBindBuffer(GL_SHADER_STORAGE_BUFFER, cubeShaderBuffer);
-				p = glMapBuffer(GL_SHADER_STORAGE_BUFFER, GL_WRITE_ONLY);
-				memcpy(p, &cubes[0], sizeof(cube)*NUM_CUBES);
-				glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
-				glUseProgram(0);
+				//Immutable storage can't be resized so the new set gets a new buffer
+				glDeleteBuffers(1, &cubeShaderBuffer);
+				cubeShaderBuffer = createCubeBuffer(cubes, NUM_CUBES);
+				glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, cubeShaderBuffer);
+				dirty.cubes = true;
 
-				float fps = 1 / AVG_DT;
-				std::cout << NUM_CUBES << " cubes at " << fps << " fps" << std::endl;
-				OUTPUT_FILE << fps << ", " << NUM_CUBES << "\n";
-				if (fps <= 10 || NUM_CUBES > 10000)
+				float rebuildMs = 0;
+				if (useQuadtree || benchmarkCulling)
 				{
-					glfwSetWindowShouldClose(window, 1);
-				}
+					auto start = std::chrono::high_resolution_clock::now();
 
-				if (useQuadtree)
-				{
 					cube firstCube = cubes[0];
 					cube lastCube = cubes[NUM_CUBES - 1];
 					glm::vec4 distance = lastCube.cubeMax - firstCube.cubeMin;
 					glm::vec4 centre = distance*0.5f;
-					quad = Quadtree<cube>(glm::vec2(centre.x, centre.y), glm::vec2(distance.x, distance.y));
+					quad.reset(glm::vec2(centre.x, centre.y), glm::vec2(distance.x, distance.y));
 					for (int i = 0; i < NUM_CUBES; i++)
 					{
 						glm::vec3 centre = getCubeCentre(cubes[i]);
-						quad.insert(cubes[i], glm::vec2(centre.x, centre.y));
+						quad.insert(i, glm::vec2(centre.x, centre.y));
 					}
+
+					auto end = std::chrono::high_resolution_clock::now();
+					rebuildMs = std::chrono::duration<float, std::milli>(end - start).count();
 				}
+
+				float fps = 1 / AVG_DT;
+				std::cout << NUM_CUBES << " cubes at " << fps << " fps" << std::endl;
+				if (useQuadtree || benchmarkCulling)
+				{
+					std::cout << "Quadtree rebuilt in " << rebuildMs << "ms: " << quad.getNodeCount() << " nodes, "
+						<< quad.getMemoryUsage() / 1024.0f << "KB" << std::endl;
+					OUTPUT_FILE << fps << ", " << NUM_CUBES << ", " << rebuildMs << ", " << quad.getMemoryUsage();
+				}
+				else
+				{
+					OUTPUT_FILE << fps << ", " << NUM_CUBES;
+				}
+				writeStageStats(stages);
+				OUTPUT_FILE << "\n";
+
+				if (fps <= 10 || NUM_CUBES > 10000)
+				{
+					closeRequested = true;
+				}
+
+				if (useOctree || benchmarkCulling)
+				{
+					buildOctree(&octree, cubes, NUM_CUBES);
+				}
+
+				if (benchmarkCulling)
+				{
+					runCullingBenchmark(&quad, &octree, cubes, NUM_CUBES, camera, VP);
+				}
+			}
+
+			if (headless || CUBE_TESTING || MODEL_TESTING)
+			{
+				printStageStats(stages);
+			}
+
+			for (int i = 0; i < stages.size(); i++)
+			{
+				stages[i]->reset();
 			}
 		}
 
 		//Check if any events have been activiated (key pressed, mouse moved etc.) and call corresponding response functions
-		glfwPollEvents();
+		if (usingGLFW)
+		{
+			glfwPollEvents();
+		}
+
+		//Textures finish decoding in the background, the model is drawn untextured until then
+		model.updateTextures();
+		if (modelTextures.empty() && model.hasTexture())
+		{
+			dirty.model = true;
+			modelTextures = model.getTextureArrays();
+			texturedMaterials = model.getTexturedMaterials(modelMaterials);
+			glDeleteBuffers(1, &materialShaderBuffer);
+			materialShaderBuffer = createStaticBuffer(texturedMaterials.data(), sizeof(Material) * texturedMaterials.size());
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, materialShaderBuffer);
+			if (useCpuRenderer || compareCpuRenderer)
+			{
+				for (int i = 0; i < modelTextures.size(); i++)
+				{
+					modelTextureLevels.push_back(readTextureLevels(modelTextures[i]));
+				}
+				cpuRaycaster.setMaterials(texturedMaterials);
+				cpuRaycaster.setTextures(&modelTextureLevels);
+			}
+		}
 
 		glViewport(0, 0, WIDTH, HEIGHT);
 		// Render
@@ -617,97 +1590,297 @@ int main()
 		glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
 		glClear(GL_COLOR_BUFFER_BIT);
 
-		VP = handleControls(&camera, &currentAngle, projection, VP, dt);
+		bool viewChanged;
+		VP = handleControls(&camera, &currentAngle, projection, VP, dt, &viewChanged);
+		dirty.camera = dirty.camera || viewChanged;
 
-		glm::mat4 inverseVP = glm::inverse(VP);
-		glm::vec4 eyeRay;
-		glm::vec2 topLeftCorner;
-		glm::vec2 botRightCorner;
+		//Benchmarks time the whole frame so they redo every stage
+		if (alwaysRender)
+		{
+			dirty = DirtyState();
+		}
 
-		glUseProgram(computeProgram.getShaderProgram());
+		//Dispatch cost scales with the pixels traced, a pixelStep^2 share of the image
+		float dispatchMs;
+		int measuredStep;
+		float shadowMs;
+		int shadowStep;
+		if (frameBudget > 0 && shadowTimer->getLatest(&shadowMs, &shadowStep))
+		{
+			shadowFullMs = shadowMs * shadowStep * shadowStep;
+		}
 
-		//Set viewing frustum corner rays in shader
-		glUniform3f(eyeUniform, camera.x, camera.y, camera.z);
+		if (frameBudget > 0 && dispatchTimer->getLatest(&dispatchMs, &measuredStep))
+		{
+			float fullMs = dispatchMs * measuredStep * measuredStep + shadowFullMs;
+			int wanted = (int)std::ceil(std::sqrt(fullMs / frameBudget));
+			//Only refine once the finer step is clearly inside the budget so it doesn't flicker
+			if (wanted < adaptiveStep && fullMs / (wanted * wanted) > 0.8f * frameBudget)
+			{
+				wanted = adaptiveStep;
+			}
+			adaptiveStep = std::min(std::max(wanted, 1), MAX_PIXEL_STEP);
+		}
 
-		eyeRay = calculateEyeRay(glm::vec4(-1, -1, 0, 1), camera, inverseVP);
-		glUniform3f(ray00Uniform, eyeRay.x, eyeRay.y, eyeRay.z);
-		topLeftCorner = glm::vec2(eyeRay.x, eyeRay.y);
+		//Nothing to do once the scene is unchanged and fully refined
+		idle = false;
+		if (dirty.camera || dirty.light || dirty.cubes || dirty.model)
+		{
+			pixelStep = adaptiveStep;
+			refinePass = 0;
+		}
+		else if (refinePass + 1 < pixelStep * pixelStep)
+		{
+			refinePass++;
+		}
+		else
+		{
+			idle = true;
+		}
 
-		eyeRay = calculateEyeRay(glm::vec4(-1, 1, 0, 1), camera, inverseVP);
-		glUniform3f(ray01Uniform, eyeRay.x, eyeRay.y, eyeRay.z);
+		if (!idle)
+		{
+			glm::mat4 inverseVP = glm::inverse(VP);
+			glm::vec3 ray00 = glm::vec3(calculateEyeRay(glm::vec4(-1, -1, 0, 1), camera, inverseVP));
+			glm::vec3 ray01 = glm::vec3(calculateEyeRay(glm::vec4(-1, 1, 0, 1), camera, inverseVP));
+			glm::vec3 ray10 = glm::vec3(calculateEyeRay(glm::vec4(1, -1, 0, 1), camera, inverseVP));
+			glm::vec3 ray11 = glm::vec3(calculateEyeRay(glm::vec4(1, 1, 0, 1), camera, inverseVP));
 
-		eyeRay = calculateEyeRay(glm::vec4(1, -1, 0, 1), camera, inverseVP);
-		glUniform3f(ray10Uniform, eyeRay.x, eyeRay.y, eyeRay.z);
+			glUseProgram(computeProgram.getShaderProgram());
 
-		eyeRay = calculateEyeRay(glm::vec4(1, 1, 0, 1), camera, inverseVP);
-		glUniform3f(ray11Uniform, eyeRay.x, eyeRay.y, eyeRay.z);
-		botRightCorner = glm::vec2(eyeRay.x, eyeRay.y);
+			//Uniforms stay set in the program, only the changed ones are sent
+			if (dirty.camera)
+			{
+				//Set viewing frustum corner rays in shader
+				glUniform3f(computeUniforms.eye, camera.x, camera.y, camera.z);
+				glUniform3f(computeUniforms.ray00, ray00.x, ray00.y, ray00.z);
+				glUniform3f(computeUniforms.ray01, ray01.x, ray01.y, ray01.z);
+				glUniform3f(computeUniforms.ray10, ray10.x, ray10.y, ray10.z);
+				glUniform3f(computeUniforms.ray11, ray11.x, ray11.y, ray11.z);
+			}
 
-		glUniform3f(lightPosUniform, 5, 5, 5);
-		glUniform1i(numCubesUniform, NUM_CUBES);
-		glUniform1i(numTriUniform, modelTriangles.size());
+			if (dirty.light)
+			{
+				glUniform3f(computeUniforms.lightPos, lightPos.x, lightPos.y, lightPos.z);
+			}
 
-		if (useQuadtree)
-		{
-			topLeftCorner = topLeftCorner*1000.f;
-			botRightCorner = botRightCorner*1000.f;
+			if (dirty.cubes || dirty.model)
+			{
+				//With culling on the shader walks visibleIndices, which only the camera or cubes change
+				glUniform1i(computeUniforms.numCubes, cullCubes ? (GLint)visibleCubes.size() : NUM_CUBES);
+				glUniform1i(computeUniforms.numTriangles, numTriangles);
+				glUniform1i(computeUniforms.useBVH, useBVH);
+				glUniform1i(computeUniforms.useVisibleCubes, cullCubes);
+				glUniform1i(computeUniforms.useTiles, useTiles);
+				glUniform1i(computeUniforms.tilesX, cubeBinner.getTilesX());
+				glUniform1i(computeUniforms.shadows, shadows);
+				glUniform1i(computeUniforms.totalCubes, NUM_CUBES);
+			}
 
-			glm::vec2 diff = glm::abs(botRightCorner - topLeftCorner);
-			glm::vec2 mid = glm::min(topLeftCorner, botRightCorner) + (diff*0.5f);
-			std::vector<cube> vec = quad.search(glm::vec2(mid.x, mid.y), glm::vec2(diff.x, diff.y));
+			//The visible set only depends on the camera and the cubes
+			bool cullingChanged = cullCubes && (dirty.camera || dirty.cubes);
+			if (cullingChanged)
+			{
+				{
+					ScopedTimer timer(&searchStats);
+					visibleCubes.clear();
+					if (useOctree)
+					{
+						octree.search(Frustum(VP), &visibleCubes);
+					}
+					else
+					{
+						searchQuadtree(&quad, camera, inverseVP, &visibleCubes);
+					}
+				}
 
-			GLvoid *data;
+				//Only the indices of the visible cubes are sent, the cubes themselves stay on the GPU
+				{
+					ScopedTimer timer(&uploadStats);
+					GLsizeiptr size = sizeof(GLuint)*visibleCubes.size();
+					void *indices = visibleCubeBuffer->beginWrite(size);
+					if (size > 0)
+					{
+						memcpy(indices, &visibleCubes[0], size);
+					}
+					visibleCubeBuffer->bindRange(5);
+				}
+				glUniform1i(computeUniforms.numCubes, visibleCubes.size());
+			}
 
-			if (vec.size() == 0)
+			//Tiles are binned from the same VP the eye rays are built from
+			if (useTiles)
 			{
-				data = nullptr;
+				ScopedTimer timer(&binningStats);
+				if (dirty.camera || dirty.cubes)
+				{
+					if (cullCubes)
+					{
+						cubeBinner.binCubes(cubes, visibleCubes.data(), visibleCubes.size(), VP);
+					}
+					else
+					{
+						cubeBinner.binCubes(cubes, nullptr, NUM_CUBES, VP);
+					}
+					cubeBinner.upload(9, 10);
+				}
+
+				if (!useBVH && (dirty.camera || dirty.model))
+				{
+					triBinner.binTriangles(vertexPositions, modelIndices, VP);
+					triBinner.upload(11, 12);
+				}
 			}
-			else
+
+			if (useCpuRenderer || compareCpuRenderer)
 			{
-				data = &vec[0];
+				cpuRaycaster.setCubes(cubes, NUM_CUBES, cullCubes ? visibleCubes.data() : nullptr, visibleCubes.size());
+				cpuRaycaster.setCamera(camera, ray00, ray01, ray10, ray11, lightPos);
 			}
 
-			glBindBuffer(GL_SHADER_STORAGE_BUFFER, cubeShaderBuffer);
-			glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(cube)*vec.size(), data, GL_STATIC_COPY);
-			glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 
-			glBindBuffer(GL_SHADER_STORAGE_BUFFER, cubeShaderBuffer);
-			p = glMapBuffer(GL_SHADER_STORAGE_BUFFER, GL_WRITE_ONLY);
-			memcpy(p, data, sizeof(cube)*vec.size());
-			glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
-			glUniform1i(numCubesUniform, vec.size());
-		}
+			//Bind framebuffer texture to image unit 0 as writable image in the shader.
+			glBindImageTexture(0, tex, 0, false, 0, GL_WRITE_ONLY, GL_RGBA32F);
+			//Bind the model's texture arrays to texture units 1 onwards for the modelTex samplers
+			for (int i = 0; i < modelTextures.size(); i++)
+			{
+				glActiveTexture(GL_TEXTURE1 + i);
+				glBindTexture(GL_TEXTURE_2D_ARRAY, modelTextures[i]);
+			}
+			glActiveTexture(GL_TEXTURE0);
 
 
+			//One invocation per pixelStep square, refinement passes move the traced pixel along the square
+			glUniform1i(computeUniforms.pixelStep, pixelStep);
+			glUniform2i(computeUniforms.pixelOffset, refinePass % pixelStep, refinePass / pixelStep);
+			glUniform1i(computeUniforms.fillBlock, refinePass == 0 && pixelStep > 1);
 
-		//Bind framebuffer texture to image unit 0 as writable image in the shader.
-		glBindImageTexture(0, tex, 0, false, 0, GL_WRITE_ONLY, GL_RGBA32F);
-		//Bind model texture to image unit 1 as readable image in the shader
-		if(model.hasTexture())
-		{
-			glBindImageTexture(1, model.getTextures()[0].id, 0, false, 0, GL_READ_ONLY, GL_RGBA32F);
-		}
+			//The first GPU frame tunes the work group size on the scene it renders
+			int tracedWidth = (WIDTH + pixelStep - 1) / pixelStep;
+			int tracedHeight = (HEIGHT + pixelStep - 1) / pixelStep;
+			if (tuneWorkGroups && !useCpuRenderer)
+			{
+				tuneWorkGroups = false;
+				glUniform1i(computeUniforms.shadowPass, false);
+				glm::ivec2 tuned = tuneWorkGroupSize(computeProgram.getShaderProgram(), tracedWidth, tracedHeight);
+				writeCachedWorkGroupSize(device, tuned);
+				std::cout << "Work group size tuned to " << tuned.x << "x" << tuned.y << std::endl;
+
+				if (tuned.x != workGroupSizeX || tuned.y != workGroupSizeY)
+				{
+					Shader tunedProgram;
+					tunedProgram.createShader("compute.csh", GL_COMPUTE_SHADER, getLocalSizeDefines(tuned));
+					tunedProgram.createProgram();
+					tunedProgram.copyUniforms(computeProgram.getShaderProgram());
+					glDeleteProgram(computeProgram.getShaderProgram());
+					computeProgram = tunedProgram;
+					computeUniforms = getComputeUniforms(computeProgram.getShaderProgram());
+					glUseProgram(computeProgram.getShaderProgram());
+					workGroupSizeX = tuned.x;
+					workGroupSizeY = tuned.y;
+				}
+			}
 
+			//One invocation per pixelStep square, rounded up to whole work groups rather
+			//than padded out to a power of two
+			int groupsX = (tracedWidth + workGroupSizeX - 1) / workGroupSizeX;
+			int groupsY = (tracedHeight + workGroupSizeY - 1) / workGroupSizeY;
 
-		//Compute appropriate invocation dimension. 
-		int worksizeX = nextPowerOfTwo(WIDTH);
-		int worksizeY = nextPowerOfTwo(HEIGHT);
+			if (useCpuRenderer)
+			{
+				ScopedTimer timer(&cpuStats);
+				cpuRaycaster.render(&cpuFramebuffer[0], WIDTH, HEIGHT);
+				glBindTexture(GL_TEXTURE_2D, tex);
+				glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, WIDTH, HEIGHT, GL_RGBA, GL_FLOAT, &cpuFramebuffer[0]);
+				glBindTexture(GL_TEXTURE_2D, 0);
+			}
+			else if (wavefront != nullptr)
+			{
+				//Shadows are a stage of the wavefront, so its whole cost is timed as the dispatch
+				if (dirty.camera || dirty.light || dirty.cubes || dirty.model)
+				{
+					wavefront->copyUniforms();
+				}
+				dispatchTimer->begin(pixelStep);
+				wavefront->render(pixelStep, refinePass % pixelStep, refinePass / pixelStep, refinePass == 0 && pixelStep > 1, reflectionDepth);
+				dispatchTimer->end();
+			}
+			else
+			{
+				//Invoke the compute shader. 
+				dispatchTimer->begin(pixelStep);
+				glUniform1i(computeUniforms.shadowPass, false);
+				glDispatchCompute(groupsX, groupsY, 1);
+				dispatchTimer->end();
+
+				//Shadow rays only need to know if anything is in the way, so they get
+				//their own any-hit dispatch over the hits the first one recorded
+				if (shadows)
+				{
+					glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+					shadowTimer->begin(pixelStep);
+					glUniform1i(computeUniforms.shadowPass, true);
+					glDispatchCompute(groupsX, groupsY, 1);
+					shadowTimer->end();
+				}
+			}
 
-		//Invoke the compute shader. 
-		glDispatchCompute(worksizeX / workGroupSizeX, worksizeY / workGroupSizeY, 1);
+			//Reset image binding. 
+			glBindImageTexture(0, 0, 0, false, 0, GL_READ_WRITE, GL_RGBA32F);
+			glBindImageTexture(1, 0, 0, false, 0, GL_READ_ONLY, GL_RGBA32F);
+			glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+			glUseProgram(0);
 
-		//Reset image binding. 
-		glBindImageTexture(0, 0, 0, false, 0, GL_READ_WRITE, GL_RGBA32F);
-		glBindImageTexture(1, 0, 0, false, 0, GL_READ_ONLY, GL_RGBA32F);
-		glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
-		glUseProgram(0);
+			//The CPU renderer always renders full resolution
+			if (compareCpuRenderer && frameNum == 0 && pixelStep == 1)
+			{
+				{
+					ScopedTimer timer(&cpuStats);
+					cpuRaycaster.render(&cpuFramebuffer[0], WIDTH, HEIGHT);
+				}
+				//glGetTexImage reads through the texture path, not the image one
+				glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+				gpuFramebuffer = readTexture(tex);
+				compareFramebuffers(cpuFramebuffer, gpuFramebuffer);
+			}
+
+			//Every dispatch reads the bound region, so it is fenced again even when it wasn't rewritten
+			if (cullingChanged)
+			{
+				visibleCubeBuffer->endFrame();
+			}
+			else if (cullCubes)
+			{
+				visibleCubeBuffer->fenceCurrent();
+			}
+
+			dirty.camera = false;
+			dirty.light = false;
+			dirty.cubes = false;
+			dirty.model = false;
+		}
+
+		if (headless)
+		{
+			//Nothing is presented, wait for the GPU so each frame's time covers its own work
+			glFinish();
+			frameTimes.push_back((getTime() - currentFrame) * 1000);
+
+			if (headlessFrames > 0 && frameTimes.size() >= headlessFrames)
+			{
+				closeRequested = true;
+			}
+			continue;
+		}
 
 		//Draw the rendered image on the screen using textured full-screen
 		//quad.
 		glUseProgram(quadProgram.getShaderProgram());
 		glBindVertexArray(vao);
 		glBindTexture(GL_TEXTURE_2D, tex);
+		blitTimer->begin();
 		glDrawArrays(GL_TRIANGLES, 0, 6);
+		blitTimer->end();
 		glBindTexture(GL_TEXTURE_2D, 0);
 		glBindVertexArray(0);
 		glUseProgram(0);
@@ -715,16 +1888,54 @@ int main()
 		//Swap the screen buffers
 		glfwSwapBuffers(window);
 	}
+	if (headless && frameTimes.size() > 0)
+	{
+		float total = 0;
+		float fastest = frameTimes[0];
+		float slowest = frameTimes[0];
+		for (int i = 0; i < frameTimes.size(); i++)
+		{
+			total += frameTimes[i];
+			fastest = std::min(fastest, frameTimes[i]);
+			slowest = std::max(slowest, frameTimes[i]);
+		}
+		float average = total / frameTimes.size();
+
+		std::cout << "Headless run: " << frameTimes.size() << " frames in " << total / 1000 << "s, avg " << average
+			<< "ms, min " << fastest << "ms, max " << slowest << "ms, " << 1000 / average << " fps" << std::endl;
+	}
+
 	//Properly de-allocate all resources once they've outlived their purpose
 	glDeleteVertexArrays(1, &vao);
-	//Terminate GLFW, clearing any resources allocated by GLFW.
-	glfwTerminate();
+	delete visibleCubeBuffer;
+	delete wavefront;
+	delete dispatchTimer;
+	delete shadowTimer;
+	delete blitTimer;
+	if (usingGLFW)
+	{
+		//Terminate GLFW, clearing any resources allocated by GLFW.
+		glfwTerminate();
+	}
+	else
+	{
+		destroyHeadlessContext(&headlessContext);
+	}
 	delete[] cubes;
-	modelTriangles.clear();
+	importedPositions.clear();
+	importedAttributes.clear();
+	importedIndices.clear();
+	importedNodes.clear();
+	sceneCache.close();
 
 	if (CUBE_TESTING || MODEL_TESTING)
 	{
 		OUTPUT_FILE.close();
 	}
+
+	if (benchmarkCulling)
+	{
+		CULLING_FILE.close();
+	}
 	return 0;
 }
\ No newline at end of file